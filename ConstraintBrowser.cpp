@@ -354,7 +354,8 @@ protected:
     void OnFinishEditItem(wxListEvent& evt)
     {
         // sanity check
-        SketchDimension* sc = dynamic_cast<SketchDimension*>(reinterpret_cast<SketchConstraint*>(evt.GetData()));
+        SketchConstraint* constraint = reinterpret_cast<SketchConstraint*>(evt.GetData());
+        SketchDimension* sc = dynamic_cast<SketchDimension*>(constraint);
         if (!sc)
             evt.Veto();
 
@@ -364,10 +365,13 @@ protected:
         if (!DimensionEditDialog::Write(sc, evt.GetLabel().mbc_str()))
             evt.Veto();
 
-        if (!sketch.Solve())
+        // the new value is reached gradually from the saved one
+        const auto value = sc->DesiredValue;
+        sc->DesiredValue = saved;
+
+        if (!sketch.SolveContinuation(*constraint, sc->DesiredValue, value))
         {
-            // failed - roll back
-            sc->DesiredValue = saved;
+            // failed - rolled back
             evt.Veto();
             return;
         }
@@ -406,7 +410,7 @@ public:
         m_list->Bind(wxEVT_LIST_END_LABEL_EDIT, &OnFinishEditItem, this);
 
         unsigned int i = 0;
-        for (std::unique_ptr<SketchConstraint>& ptr : sketch.constraints)
+        for (const std::unique_ptr<SketchConstraint>& ptr : sketch.constraints)
         {
             SketchConstraint* const sc = ptr.get();
             if (!sc)
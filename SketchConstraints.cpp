@@ -18,6 +18,7 @@
 #include <glm/gtx/norm.hpp>
 #include <iostream>
 #include <algorithm>
+#include <atomic>
 #include <glm/gtx/vector_angle.hpp>
 
 /// GENERIC CONSTRAINT
@@ -35,12 +36,27 @@ IMPLEMENT_POLYMORPHIC_SERIALIZATION_MEMBERS(SketchConstraint)
 
 /// CONSTRAINT LIST
 /// =========================================================================================
+void SketchConstraintList::Modified()
+{
+    static std::atomic<size_t> last_revision{0}; // lists are changed from more than one thread (the solver threads and the GUI)
+    current_revision = ++last_revision;
+}
+
 SketchConstraintList::iterator SketchConstraintList::add(SketchConstraint* sc)
 {
     emplace_back( std::unique_ptr<SketchConstraint>(sc) );
     return std::prev(end());
 }
 
+std::unique_ptr<SketchConstraint> SketchConstraintList::release(const_iterator pos)
+{
+    base::iterator iter = base::erase(pos, pos); // same position, but not const
+    std::unique_ptr<SketchConstraint> constraint = std::move(*iter);
+
+    erase(iter);
+    return constraint;
+}
+
 SketchConstraintList::iterator SketchConstraintList::FindAssociated(const SketchPointList::iterator& point, const SketchConstraintList::iterator& first)
 {
     return std::find_if(first, end(), [&point](const std::unique_ptr<SketchConstraint>& constraint) -> bool {
@@ -64,21 +80,21 @@ SketchConstraintList::iterator SketchConstraintList::FindAssociated(const Sketch
 
 void SketchConstraintList::erase_associated(const SketchPointList::iterator& point)
 {
-    erase(std::remove_if(begin(), end(), [&point](const std::unique_ptr<SketchConstraint>& constraint) -> bool {
+    erase(std::remove_if(base::begin(), base::end(), [&point](const std::unique_ptr<SketchConstraint>& constraint) -> bool {
         return constraint->IsAssociatedTo(point);
     }), end());
 }
 
 void SketchConstraintList::erase_associated(const SketchLineList::iterator& line)
 {
-    erase(std::remove_if(begin(), end(),  [&line](const std::unique_ptr<SketchConstraint>& constraint) -> bool {
+    erase(std::remove_if(base::begin(), base::end(),  [&line](const std::unique_ptr<SketchConstraint>& constraint) -> bool {
         return constraint->IsAssociatedTo(line);
     }), end());
 }
 
 void SketchConstraintList::erase_associated(const SketchCircleList::iterator& circle)
 {
-    erase(std::remove_if(begin(), end(), [&circle](const std::unique_ptr<SketchConstraint>& constraint) -> bool {
+    erase(std::remove_if(base::begin(), base::end(), [&circle](const std::unique_ptr<SketchConstraint>& constraint) -> bool {
         return constraint->IsAssociatedTo(circle);
     }), end());
 }
@@ -54,10 +54,27 @@ DECLARE_SERIALIZATION_SCHEME(SketchConstraint)
 // This is a container for SketchConstraint
 // Constraints are stored as pointers to allow polymorphism
 // A list of unique_ptr is used to avoid leaks
+// Every change to the list gives it a new revision number, so whoever keeps data derived from the constraints (the solver) knows when to rebuild it
+// The list itself is private, so it can only be changed by the methods below (the iterators are all const - the constraints they point to are not)
 // =========================================================================================
-class SketchConstraintList : public std::list<std::unique_ptr<SketchConstraint>>
+class SketchConstraintList : private std::list<std::unique_ptr<SketchConstraint>>
 {
 public:
+    using base = std::list<std::unique_ptr<SketchConstraint>>;
+    using value_type = base::value_type;
+    using size_type = base::size_type;
+    using iterator = base::const_iterator;
+    using const_iterator = base::const_iterator;
+
+    inline SketchConstraintList() { Modified(); }
+
+    inline iterator begin() const { return base::cbegin(); }
+    inline iterator end() const { return base::cend(); }
+    inline const value_type& front() const { return base::front(); }
+    inline const value_type& back() const { return base::back(); }
+    using base::size;
+    using base::empty;
+
     iterator FindAssociated(const SketchPointList::iterator& point, const iterator& first);
     iterator FindAssociated(const SketchLineList::iterator& line, const iterator& first);
     iterator FindAssociated(const SketchCircleList::iterator& circle, const iterator& first);
@@ -67,10 +84,31 @@ public:
     void erase_associated(const SketchCircleList::iterator& circle);
 
     iterator add(SketchConstraint* sc);
+
+    // same as the std::list methods, but changing the revision
+    template<class... Args>
+    inline void emplace_back(Args&&... args) { base::emplace_back(std::forward<Args>(args)...); Modified(); }
+    inline iterator erase(const_iterator pos) { Modified(); return base::erase(pos); }
+    inline iterator erase(const_iterator first, const_iterator last) { Modified(); return base::erase(first, last); }
+
+    // removes the constraint from the list, giving it back
+    std::unique_ptr<SketchConstraint> release(const_iterator pos);
+
+    // unique among all the lists and all their changes - two lists (or two states of the same list) never have the same revision
+    inline size_t revision() const { return current_revision; }
+
+    // gives the list a new revision (done by every method above that changes it) - also to be called after changing a constraint in place
+    void Modified();
+
+protected:
+    size_t current_revision = 0;
+
+    friend bool operator>>(const SerializationInValue& in, SketchConstraintList& data);
+    friend bool operator<<(SerializationOut& out, const SketchConstraintList& data);
 };
 
-inline bool operator>>(const SerializationInValue& in, SketchConstraintList& data) { return operator>>(in,  (std::list<std::unique_ptr<SketchConstraint>>&)data); }
-inline bool operator<<(SerializationOut& out, const SketchConstraintList& data)    { return operator<<(out, (const std::list<std::unique_ptr<SketchConstraint>>&)data); }
+inline bool operator>>(const SerializationInValue& in, SketchConstraintList& data) { data.Modified(); return operator>>(in,  static_cast<SketchConstraintList::base&>(data)); }
+inline bool operator<<(SerializationOut& out, const SketchConstraintList& data)    { return operator<<(out, static_cast<const SketchConstraintList::base&>(data)); }
 
 // COMMON BASES FOR CONSTRAINTS
 // ============================================================================
@@ -95,6 +95,11 @@ ConstraintEquationHessian ConstraintEquation::get_hessian()
     return {};
 }
 
+bool ConstraintEquation::get_equality(Param*& a, Param*& b)
+{
+    return false;
+}
+
 // PROTOTYPES
 // ========================================================================================
 
@@ -244,6 +249,13 @@ ConstraintEquationGradient PointsCoincidentAxis::get_gradient()
     };
 }
 
+bool PointsCoincidentAxis::get_equality(Param*& a, Param*& b)
+{
+    a = bIsX ? &ax : &ay;
+    b = bIsX ? &bx : &by;
+    return true;
+}
+
 // PointOnMidpoint
 // =================================
 PointOnMidpoint::PointOnMidpoint(SketchPointList::iterator& point, SketchLineList::iterator& line, bool bX) :
@@ -574,7 +586,7 @@ ConstraintEquationHessian CirclesEqualRadius::get_hessian()
         { &r1y, &c1y,  2},
 
         { &c1x, &c1x, -2},
-        { &c1x, &c1x, -2},
+        { &c1y, &c1y, -2},
     };
 }
 
@@ -118,6 +118,7 @@ struct ConstraintEquation
     virtual Param current_value() const = 0;
     virtual ConstraintEquationGradient get_gradient() = 0;
     virtual ConstraintEquationHessian get_hessian(); // not all equations return a Hessian;
+    virtual bool get_equality(Param*& a, Param*& b); // true if the equation only states a = b (then the solver may merge both parameters)
 };
 
 // PROTOTYPES
@@ -237,6 +238,7 @@ public:
 
     Param current_value() const;
     ConstraintEquationGradient get_gradient();
+    bool get_equality(Param*& a, Param*& b);
 };
 
 
@@ -0,0 +1,3560 @@
+/// Sketchnator
+/// Copyright (C) 2021 Luiz Gustavo Pfitscher e Feldmann
+///
+/// This program is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <list>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <Eigen/Eigen>
+#include <Eigen/Sparse>
+#include <iostream>
+#include "sketch.h"
+#include "SketchSolver.h"
+
+//#define DEBUG_SKETCH_SOLVER
+
+// CONTEXT
+// Encapsulates the solver state (equations, parameters etc)
+// ====================================================================================================
+struct SolverContext
+{
+public:
+    using Param = ConstraintEquation::Param;
+
+protected:
+    // class cannot be copied or assigned - it must be created from an existing sketch
+    SolverContext() = default;
+
+    SolverContext(const SolverContext& other) = delete; // non-copyable
+    SolverContext& operator=(const SolverContext& other) = delete; // non-assignable
+
+    // the original values of the parameters are saved, in case we desire to revert it back to previous state
+    std::map<Param*, Param> original_parameters;
+
+    // equations and parameters are managed under the hood - cannot be accessed directly
+    // because we must guarantee that every parameter in 'equations' is listed in 'parameters'
+    // and 'parameters' does not contain any parameter not used by 'equations'
+    // any mismatch could make the matrix singular (for example, unused parameter would cause column of zeros)
+    std::list<std::unique_ptr<ConstraintEquation>> equations;
+    std::set<Param*> parameters;
+
+    // parameters merged by the presolve, each one is mapped to the representative listed in 'parameters'
+    std::map<Param*, Param*> aliases;
+
+    // how the parameters of under-constrained blocks should move (optional, shared by all the blocks split from this context)
+    const SketchSolverMotion* motion = nullptr;
+
+public:
+    SolverContext(SolverContext&& other) = default; // movable
+    SolverContext(Sketch& sketch, const std::vector<Param*>& constantParameters = {}, const SketchSolverMotion* m = nullptr) :
+        motion(m)
+    {
+        // insert the equations present in the sketch
+        for (const std::unique_ptr<SketchConstraint>& constraint : sketch.constraints)
+        {
+            ConstraintEquation* equ = constraint->GetEquation();
+            if (!equ)
+                continue;
+
+            add(std::unique_ptr<ConstraintEquation>( equ ), constantParameters);
+        }
+    }
+
+    // same as above, without the equation of one of the constraints (to classify it against the others)
+    SolverContext(Sketch& sketch, const SketchConstraint& excluded)
+    {
+        for (const std::unique_ptr<SketchConstraint>& constraint : sketch.constraints)
+        {
+            if (constraint.get() == &excluded)
+                continue;
+
+            ConstraintEquation* equ = constraint->GetEquation();
+            if (!equ)
+                continue;
+
+            add(std::unique_ptr<ConstraintEquation>( equ ));
+        }
+    }
+
+    // a context of a single equation
+    SolverContext(std::unique_ptr<ConstraintEquation>&& equ, const std::vector<Param*>& constantParameters = {}, const SketchSolverMotion* m = nullptr) :
+        motion(m)
+    {
+        add(std::move(equ), constantParameters);
+    }
+
+    // inserts one equation, and all the parameters it's gradient exposes
+    void add(std::unique_ptr<ConstraintEquation>&& equ, const std::vector<Param*>& constantParameters = {})
+    {
+        // get all the parameters it's gradient exposes
+        for (const ConstraintEquationDerivative& der : equ->get_gradient())
+        {
+            // check if this parameter is to be made constant
+            if (std::find(constantParameters.cbegin(), constantParameters.cend(), der.parameter) != constantParameters.cend())
+                continue; // if constant, the gradient parameter is not listed
+
+            // merged by the presolve - it's representative is listed instead
+            if (aliases.count(der.parameter) != 0)
+                continue;
+
+            // if the parameter is being inserted (first time encountered)...
+            if (parameters.insert( der.parameter ).second)
+                original_parameters.insert({der.parameter, *der.parameter}); // then save it's present value
+        }
+
+        equations.emplace_back( std::move(equ) );
+    }
+
+    // transfers content from other to inside this
+    // other is left empty
+    void splice(SolverContext& other)
+    {
+        // move the equations (they will never repeat because unique ownership)
+        equations.splice(equations.end(), other.equations);
+
+        // move the parameters
+        for (Param* p : other.parameters)
+            if (parameters.insert( p ).second)
+                original_parameters.insert({p, *p});
+
+        aliases.insert(other.aliases.cbegin(), other.aliases.cend());
+
+        if (!motion)
+            motion = other.motion;
+
+        other.parameters.clear();
+        other.original_parameters.clear();
+        other.aliases.clear();
+    }
+
+    // splits one instance into blocks, where equations sharing parameters are grouped in a block, and no blocks share a parameters
+    // the parameters are grouped by union-find over their indices - every gradient entry is visited once, so it is near-linear in the size of the sketch
+    static void BlockSplit(SolverContext&& src, std::list<SolverContext>& dst)
+    {
+        // index of each parameter
+        std::unordered_map<Param*, unsigned int> index;
+        index.reserve(src.parameters.size());
+        for (Param* p : src.parameters)
+            index.emplace(p, index.size());
+
+        std::vector<unsigned int> parent(index.size());
+        for (unsigned int i = 0; i < parent.size(); i++)
+            parent[i] = i;
+
+        auto find = [&parent](unsigned int i) -> unsigned int {
+            while (parent[i] != i)
+                i = parent[i] = parent[parent[i]]; // path halving
+
+            return i;
+        };
+
+        // the first parameter of each equation (in the index), or none if it depends on constants only
+        const unsigned int none = std::numeric_limits<unsigned int>::max();
+        std::vector<unsigned int> first;
+
+        // parameters used by the same equation are in the same block
+        for (const std::unique_ptr<ConstraintEquation>& equ : src.equations)
+        {
+            first.push_back(none);
+
+            if (!equ)
+                continue;
+
+            for (const ConstraintEquationDerivative& der : equ->get_gradient())
+            {
+                auto iter = index.find(der.parameter);
+                if (iter == index.end())
+                    continue; // constant
+
+                if (first.back() == none)
+                {
+                    first.back() = iter->second;
+                    continue;
+                }
+
+                unsigned int ra = find(first.back());
+                unsigned int rb = find(iter->second);
+                if (ra != rb)
+                    parent[rb] = ra;
+            }
+        }
+
+        // one context per group, in the order their first equation appears
+        std::vector<SolverContext*> block(parent.size(), nullptr);
+        auto newContext = [&dst, &src]() -> SolverContext* {
+            dst.emplace_back( SolverContext() );
+            dst.back().motion = src.motion;
+            return &dst.back();
+        };
+
+        unsigned int e = 0;
+        for (std::unique_ptr<ConstraintEquation>& equ : src.equations)
+        {
+            unsigned int f = first[e++];
+            if (!equ)
+                continue;
+
+            // equations without parameters are blocks of their own
+            SolverContext* context;
+            if (f == none)
+                context = newContext();
+            else
+            {
+                SolverContext*& root = block[find(f)];
+                if (!root)
+                    root = newContext();
+
+                context = root;
+            }
+
+            context->equations.emplace_back( std::move(equ) );
+        }
+
+        for (auto& pair : index)
+        {
+            SolverContext* context = block[find(pair.second)];
+            if (!context)
+                continue; // not used by any equation
+
+            context->parameters.insert( pair.first );
+
+            auto original = src.original_parameters.find(pair.first);
+            context->original_parameters.insert({pair.first, (original != src.original_parameters.end()) ? original->second : *pair.first});
+        }
+
+        // merged parameters go with their representative
+        for (auto& pair : src.aliases)
+        {
+            auto iter = index.find(pair.second);
+            if (iter == index.end())
+                continue;
+
+            SolverContext* context = block[find(iter->second)];
+            if (context)
+                context->aliases.insert(pair);
+        }
+    }
+
+    // splits the equations into subsystems, each given by the positions of it's equations (in this context) and the parameters it is solved for
+    // every equation must belong to exactly one subsystem - they are all moved out, but the parameters stay listed here so they can still be rolled back
+    // the equations are returned by splicing the subsystems back into this context
+    void SequenceSplit(const std::vector<std::vector<unsigned int>>& subsystem_equations, const std::vector<std::vector<Param*>>& subsystem_parameters, std::list<SolverContext>& dst)
+    {
+        std::vector<std::unique_ptr<ConstraintEquation>*> position;
+        for (std::unique_ptr<ConstraintEquation>& equ : equations)
+            position.push_back(&equ);
+
+        std::map<Param*, SolverContext*> owner;
+        for (size_t s = 0; s < subsystem_equations.size(); s++)
+        {
+            dst.emplace_back( SolverContext() );
+            SolverContext& newContext = dst.back();
+            newContext.motion = motion;
+
+            for (Param* p : subsystem_parameters[s])
+            {
+                owner[p] = &newContext;
+                if (newContext.parameters.insert( p ).second)
+                    newContext.original_parameters.insert({p, *p});
+            }
+
+            for (unsigned int e : subsystem_equations[s])
+                newContext.equations.emplace_back( std::move(*position[e]) );
+        }
+
+        // merged parameters go with their representative
+        for (auto& pair : aliases)
+        {
+            auto iter = owner.find(pair.second);
+            if (iter != owner.end())
+                iter->second->aliases.insert(pair);
+        }
+
+        equations.clear();
+    }
+
+    // PRESOLVE
+    // equations only stating two parameters are equal (coincident points, horizontal and vertical lines) are removed from the system
+    // instead, the parameters are merged into a single variable (union-find), so the system to be solved is smaller
+    // the merged variable starts from the average of it's members, and it's value is copied to every alias (Propagate)
+    // a context presolved before (kept by a session, with equations added since) starts from the merges it already has, so groups keep growing
+    void Presolve()
+    {
+        std::map<Param*, Param*> parent(aliases.cbegin(), aliases.cend());
+        auto find = [&parent](Param* p) -> Param* {
+            Param* root = p;
+            for (auto iter = parent.find(root); iter != parent.end() && iter->second != root; iter = parent.find(root))
+                root = iter->second;
+
+            // path compression
+            while (p != root)
+            {
+                Param*& next = parent[p];
+                p = next;
+                next = root;
+            }
+
+            return root;
+        };
+
+        bool bMerged = false;
+        for (auto iter = equations.begin(); iter != equations.end(); )
+        {
+            Param* a;
+            Param* b;
+
+            // equalities involving a constant parameter are kept - the constant could not be merged
+            if (!iter->get()->get_equality(a, b) || !contains(resolve(a)) || !contains(resolve(b)))
+            {
+                iter++;
+                continue;
+            }
+
+            Param* ra = find(a);
+            Param* rb = find(b);
+            if (ra != rb)
+            {
+                parent[rb] = ra;
+                bMerged = true;
+            }
+
+            iter = equations.erase(iter);
+        }
+
+        if (!bMerged)
+            return;
+
+        // every member is aliased to the final representative of it's group - a representative merged into another group is no longer one
+        // each group of merged parameters starts from the average of it's members
+        std::map<Param*, std::pair<Param, unsigned int>> average;
+        for (auto& pair : parent)
+        {
+            Param* root = find(pair.first);
+            aliases[pair.first] = root;
+            parameters.erase(pair.first);
+
+            auto& sum = average.emplace(root, std::make_pair(*root, 1)).first->second;
+            sum.first += *pair.first;
+            sum.second++;
+        }
+
+        #ifdef DEBUG_SKETCH_SOLVER
+        for (auto& pair : aliases)
+            if (!contains(pair.second) || aliases.count(pair.second) != 0)
+                std::cout << "Presolve left an alias to a parameter that is not solved for" << std::endl;
+        #endif
+
+        for (auto& pair : average)
+            *pair.first = pair.second.first / pair.second.second;
+
+        Propagate();
+    }
+
+    // copies the value of each merged variable to all of it's aliases
+    void Propagate()
+    {
+        for (auto& pair : aliases)
+            *pair.first = *pair.second;
+    }
+
+    // the parameter that actually holds the value of p (p itself, unless it was merged)
+    inline Param* resolve(Param* p) const
+    {
+        auto iter = aliases.find(p);
+        return (iter == aliases.cend()) ? p : iter->second;
+    }
+
+    // assigns each managed parameter pointer it's original value (from when it was first encountered)
+    void RollBack()
+    {
+        for (auto& pair : original_parameters)
+            *pair.first = pair.second;
+    }
+
+    // prepares a context kept from a previous solve (by a session) for solving again, from the present values of the parameters
+    // they become the values rolled back to, and each group of merged parameters restarts from the average of it's members (as the presolve does)
+    void Rebase(const SketchSolverMotion* m)
+    {
+        motion = m;
+
+        for (auto& pair : original_parameters)
+            pair.second = *pair.first;
+
+        if (aliases.empty())
+            return;
+
+        std::map<Param*, std::pair<Param, unsigned int>> average;
+        for (auto& pair : aliases)
+        {
+            auto& sum = average.emplace(pair.second, std::make_pair(*pair.second, 1)).first->second;
+            sum.first += *pair.first;
+            sum.second++;
+        }
+
+        for (auto& pair : average)
+            *pair.first = pair.second.first / pair.second.second;
+
+        Propagate();
+    }
+
+    inline const SketchSolverMotion* get_motion() const { return motion; }
+
+    // checks if the parameter is solved for in this context (not constant)
+    inline bool contains(Param* p) const { return parameters.count(p) != 0; }
+
+    // gets sizes
+    inline size_t size_equations () const { return equations.size(); }
+    inline size_t size_parameters() const { return parameters.size();}
+
+    // iterates for the equations and parameters
+    inline decltype(equations)::iterator begin_equ() { return equations.begin(); }
+    inline decltype(equations)::iterator end_equ() { return equations.end(); }
+    inline decltype(equations)::const_iterator cbegin_equ() const { return equations.cbegin(); }
+    inline decltype(equations)::const_iterator cend_equ() const { return equations.cend(); }
+
+    inline decltype(parameters)::iterator begin_par() { return parameters.begin(); }
+    inline decltype(parameters)::iterator end_par() { return parameters.end(); }
+    inline decltype(parameters)::const_iterator cbegin_par() const { return parameters.cbegin(); }
+    inline decltype(parameters)::const_iterator cend_par() const { return parameters.cend(); }
+
+    inline decltype(aliases)::const_iterator cbegin_ali() const { return aliases.cbegin(); }
+    inline decltype(aliases)::const_iterator cend_ali() const { return aliases.cend(); }
+};
+
+// PARAMETERS
+// Configurations, convergence criteria
+// ====================================================================================================
+const static size_t max_iter = 40; // Newton-Raphson usually converges really quickly
+const static SolverContext::Param absError = 1E-4; // distance left to satisfy the (equilibrated) equations - if the sketch is in mm units, precision is 0.1um
+const static SolverContext::Param relError = 1E-4; // change of the step between refinements
+const static SolverContext::Param precision = 1E-12; // relative precision of the coordinates (some of the 16 digits of a double are lost to round-off)
+
+// TIME BUDGET
+// Interactive solves (every frame of a drag) may be given a limited time, so a large sketch still keeps up with the mouse
+// The numeric methods check it after every step, and stop at the best iterate found so far once it runs out (it is not a failure)
+// Solving again later continues where it stopped - after enough solves (or one without a budget) the blocks converge as usual
+// ====================================================================================================
+class Deadline
+{
+public:
+    Deadline(const SketchSolverOptions& options) :
+        bLimited(options.timeBudget > 0),
+        end(std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(options.timeBudget)))
+    {
+
+    }
+
+    inline bool expired() const { return bLimited && std::chrono::steady_clock::now() >= end; }
+
+protected:
+    const bool bLimited;
+    const std::chrono::steady_clock::time_point end;
+};
+
+// LINEAR SOLVER
+// Factorizes the matrix of the system once, and then solves it for any given right hand side
+// The inverse is never computed explicitly
+// ====================================================================================================
+// columns of square and tall matrices are scaled to unit norm, which improves the conditioning without changing the (least squares) solution
+// the columns of wide matrices are kept, since scaling them would change which solution has the minimum norm
+template<class MatrixType>
+static Eigen::Matrix<typename MatrixType::Scalar, Eigen::Dynamic, 1> ColumnScale(const MatrixType& in)
+{
+    Eigen::Matrix<typename MatrixType::Scalar, Eigen::Dynamic, 1> scale = Eigen::Matrix<typename MatrixType::Scalar, Eigen::Dynamic, 1>::Ones(in.cols());
+    if (in.rows() < in.cols())
+        return scale;
+
+    for (Eigen::Index col = 0; col < in.cols(); col++)
+    {
+        const typename MatrixType::Scalar norm = in.col(col).norm();
+        if (norm > 0)
+            scale(col) = 1 / norm;
+    }
+
+    return scale;
+}
+
+class LinearSolver
+{
+public:
+    using Param = SolverContext::Param;
+    using Matrix = Eigen::Matrix<Param, Eigen::Dynamic, Eigen::Dynamic>;
+    using Vector = Eigen::Matrix<Param, Eigen::Dynamic, 1>;
+
+    LinearSolver(SketchSolverDecomposition d) :
+        policy(d)
+        { }
+
+    // factorizes the matrix, returns false if it is singular
+    bool Factorize(const Matrix& unscaled)
+    {
+        scale = ColumnScale(unscaled);
+        const Matrix in = unscaled * scale.asDiagonal();
+
+        if (in.rows() == in.cols())
+            shape = SQUARE;
+        else if (in.rows() > in.cols())
+            shape = TALL;
+        else
+            shape = WIDE;
+
+        method = policy;
+        if (method == SketchSolverDecomposition::AUTOMATIC)
+        {
+            // the fastest on each shape (see SolverBenchmark.cpp) - the block is equilibrated, so squaring it's condition number is usually harmless
+            switch (shape)
+            {
+                case SQUARE:    method = SketchSolverDecomposition::PARTIAL_PIVOT_LU;   break; // cheapest for a square block
+                case TALL:      method = SketchSolverDecomposition::CHOLESKY_LLT;       break; // the normal matrix J^t*J is the smallest side
+                case WIDE:      method = SketchSolverDecomposition::CHOLESKY_LLT;       break; // the normal matrix J*J^t is the smallest side
+            }
+        }
+
+        bool bSingular = Decompose(in);
+
+        // unless it is nearly singular - then the normal equations lose too much precision, and the matrix itself is factorized instead
+        if (bSingular && policy == SketchSolverDecomposition::AUTOMATIC && method == SketchSolverDecomposition::CHOLESKY_LLT)
+        {
+            method = SketchSolverDecomposition::HOUSEHOLDER_QR;
+            bSingular = Decompose(in);
+        }
+
+        #ifdef DEBUG_SKETCH_SOLVER
+        if (bSingular)
+        {
+            std::cerr << "Matrix is singular" << std::endl;
+            std::cout << in << std::endl;
+        }
+        #endif
+
+        return !bSingular;
+    }
+
+    // solves the factorized system for a right hand side (least squares if tall, minimum norm if wide)
+    bool Solve(const Vector& b, Vector& out) const
+    {
+        switch (method)
+        {
+            case SketchSolverDecomposition::HOUSEHOLDER_QR:
+                if (shape == WIDE)
+                {
+                    // J^t P = Q R  =>  x = Q [z 0]^t  where  R1^t z = P^t b
+                    const auto rank = qr.rank();
+                    Vector z = Vector::Zero(qr.rows());
+                    z.head(rank) = qr.matrixQR().topLeftCorner(rank, rank).template triangularView<Eigen::Upper>().transpose().solve(qr.colsPermutation().transpose() * b);
+                    out = qr.householderQ() * z;
+                }
+                else
+                    out = qr.solve(b);
+                break;
+
+            case SketchSolverDecomposition::COMPLETE_ORTHOGONAL:
+                out = cod.solve(b);
+                break;
+
+            case SketchSolverDecomposition::PARTIAL_PIVOT_LU:
+                if (shape == SQUARE)
+                {
+                    out = lu.solve(b);
+                    break;
+                }
+                /* fall through */
+
+            default:
+                // tall: (J^t J) x = J^t b
+                // wide: x = J^t y  where  (J J^t) y = b
+                if (shape == WIDE)
+                    out = transposed * SolveNormal(b);
+                else
+                    out = SolveNormal(transposed * b);
+                break;
+        }
+
+        out.array() *= scale.array();
+        return out.allFinite();
+    }
+
+protected:
+    const SketchSolverDecomposition policy; // the configured decomposition
+    SketchSolverDecomposition method;       // the decomposition actually used for the current matrix (resolved from AUTOMATIC)
+    enum { SQUARE, TALL, WIDE } shape;
+
+    Matrix transposed; // required to solve the normal equations
+    Vector scale;      // of the columns
+
+    Eigen::PartialPivLU<Matrix> lu;
+    Eigen::LLT<Matrix> llt;
+    Eigen::LDLT<Matrix> ldlt;
+    Eigen::ColPivHouseholderQR<Matrix> qr;
+    Eigen::CompleteOrthogonalDecomposition<Matrix> cod;
+
+    // factorizes the (scaled) matrix by the method chosen, returns true if it is singular
+    bool Decompose(const Matrix& in)
+    {
+        switch (method)
+        {
+            case SketchSolverDecomposition::HOUSEHOLDER_QR:
+                // a wide matrix is factorized transposed, so the minimum norm solution can be taken
+                qr.compute(shape == WIDE ? in.transpose() : in);
+                return (qr.rank() < std::min(in.rows(), in.cols()));
+
+            case SketchSolverDecomposition::COMPLETE_ORTHOGONAL:
+                cod.compute(in);
+                return (cod.rank() < std::min(in.rows(), in.cols()));
+
+            case SketchSolverDecomposition::PARTIAL_PIVOT_LU:
+                if (shape == SQUARE)
+                {
+                    lu.compute(in);
+                    return IsSingular(lu.matrixLU().diagonal());
+                }
+                /* fall through */
+
+            default:
+                // factorize the normal equations
+                transposed = in.transpose();
+                return FactorizeNormal(shape == WIDE ? Matrix(in * transposed) : Matrix(transposed * in));
+        }
+    }
+
+    // a factorization of a singular matrix may succeed, but it leaves (almost) zero pivots on the diagonal
+    // the normal equations square the condition number, so their round-off is also squared
+    template<class Derived>
+    static bool IsSingular(const Eigen::MatrixBase<Derived>& diagonal, bool bNormal = false)
+    {
+        const Vector pivots = diagonal.cwiseAbs();
+        const Param tolerance = (bNormal ? pivots.size() * pivots.size() : pivots.size()) * std::numeric_limits<Param>::epsilon();
+        return (pivots.size() == 0) || (pivots.minCoeff() <= pivots.maxCoeff() * tolerance);
+    }
+
+    bool FactorizeNormal(const Matrix& normal)
+    {
+        switch (method)
+        {
+            case SketchSolverDecomposition::CHOLESKY_LLT:
+                llt.compute(normal);
+                return (llt.info() != Eigen::Success) || IsSingular(llt.matrixLLT().diagonal().cwiseAbs2(), true);
+
+            case SketchSolverDecomposition::CHOLESKY_LDLT:
+                ldlt.compute(normal);
+                return (ldlt.info() != Eigen::Success) || IsSingular(ldlt.vectorD(), true);
+
+            default:
+                lu.compute(normal);
+                return IsSingular(lu.matrixLU().diagonal(), true);
+        }
+    }
+
+    Vector SolveNormal(const Vector& b) const
+    {
+        switch (method)
+        {
+            case SketchSolverDecomposition::CHOLESKY_LLT:   return llt.solve(b);
+            case SketchSolverDecomposition::CHOLESKY_LDLT:  return ldlt.solve(b);
+            default:                                        return lu.solve(b);
+        }
+    }
+};
+
+// SPARSE SOLVE
+// Large blocks are never inverted explicitly - each equation touches at most a handful of parameters, so the jacobian is mostly zeros
+// ====================================================================================================
+using SparseMatrix = Eigen::SparseMatrix<SolverContext::Param>;
+using SparseTriplet = Eigen::Triplet<SolverContext::Param>;
+
+// the LDLT of a singular (semi-definite) matrix succeeds, but leaves (almost) zero pivots on the diagonal
+static bool IsSingularLDLT(const Eigen::SimplicialLDLT<SparseMatrix>& ldlt)
+{
+    if (ldlt.info() != Eigen::Success)
+        return true;
+
+    const Eigen::Matrix<SolverContext::Param, Eigen::Dynamic, 1> pivots = ldlt.vectorD().cwiseAbs();
+    return pivots.minCoeff() <= pivots.maxCoeff() * pivots.size() * std::numeric_limits<SolverContext::Param>::epsilon();
+}
+
+// same as the linear solver, the factorization is kept so it may be reused for many right hand sides
+class SparseLinearSolver
+{
+public:
+    using Param = SolverContext::Param;
+    using Vector = Eigen::Matrix<Param, Eigen::Dynamic, 1>;
+
+    // factorizes the matrix, returns false if it is singular
+    bool Factorize(const SparseMatrix& unscaled)
+    {
+        scale = ColumnScale(unscaled);
+        const SparseMatrix in = unscaled * scale.asDiagonal();
+
+        if (in.rows() == in.cols())
+        {
+            shape = SQUARE;
+            qr.compute(in);
+            if (qr.info() != Eigen::Success || qr.rank() < in.cols())
+            {
+                #ifdef DEBUG_SKETCH_SOLVER
+                std::cerr << "Square sparse matrix QR: Matrix is singular" << std::endl;
+                #endif
+
+                return false;
+            }
+
+            return true;
+        }
+
+        // tall matrix: least squares solution of the normal equations (J^t J) x = J^t b
+        // wide matrix: minimum norm solution x = J^t y where (J J^t) y = b
+        shape = (in.rows() > in.cols()) ? TALL : WIDE;
+        transposed = in.transpose();
+        ldlt.compute(shape == TALL ? SparseMatrix(transposed * in) : SparseMatrix(in * transposed));
+
+        if (IsSingularLDLT(ldlt))
+        {
+            #ifdef DEBUG_SKETCH_SOLVER
+            std::cerr << (shape == TALL ? "Tall" : "Wide") << " sparse matrix LDLT: Matrix is singular" << std::endl;
+            #endif
+
+            return false;
+        }
+
+        return true;
+    }
+
+    // solves the factorized system for a right hand side
+    bool Solve(const Vector& b, Vector& out) const
+    {
+        switch (shape)
+        {
+            case SQUARE:    out = qr.solve(b);                      break;
+            case TALL:      out = ldlt.solve(transposed * b);       break;
+            case WIDE:      out = transposed * ldlt.solve(b);       break;
+        }
+
+        out.array() *= scale.array();
+        return out.allFinite();
+    }
+
+protected:
+    enum { SQUARE, TALL, WIDE } shape;
+
+    SparseMatrix transposed; // required to solve the normal equations
+    Vector scale;            // of the columns
+
+    Eigen::SparseQR<SparseMatrix, Eigen::COLAMDOrdering<int>> qr;
+    Eigen::SimplicialLDLT<SparseMatrix> ldlt;
+};
+
+static bool SparseSolve(const SparseMatrix& in, const Eigen::Matrix<SolverContext::Param, Eigen::Dynamic, 1>& b, Eigen::Matrix<SolverContext::Param, Eigen::Dynamic, 1>& out)
+{
+    SparseLinearSolver solver;
+    return solver.Factorize(in) && solver.Solve(b, out);
+}
+
+// ITERATIVE SOLVE
+// Very large blocks are not factorized at all - the least squares solution is approximated by conjugate gradients (CGLS)
+// The matrix is only used through the products J*x and J^t*y, computed directly from it's non-zero entries (memory is linear on their count)
+// ====================================================================================================
+// out = J*x
+static void MultiplyTriplets(const std::vector<SparseTriplet>& in, const Eigen::Matrix<SolverContext::Param, Eigen::Dynamic, 1>& x, Eigen::Matrix<SolverContext::Param, Eigen::Dynamic, 1>& out)
+{
+    out.setZero();
+    for (const SparseTriplet& t : in)
+        out(t.row()) += t.value() * x(t.col());
+}
+
+// out = J^t*y
+static void MultiplyTransposedTriplets(const std::vector<SparseTriplet>& in, const Eigen::Matrix<SolverContext::Param, Eigen::Dynamic, 1>& y, Eigen::Matrix<SolverContext::Param, Eigen::Dynamic, 1>& out)
+{
+    out.setZero();
+    for (const SparseTriplet& t : in)
+        out(t.col()) += t.value() * y(t.row());
+}
+
+// diagonal of J^t*J
+static Eigen::Matrix<SolverContext::Param, Eigen::Dynamic, 1> ColumnsSquaredNormTriplets(const std::vector<SparseTriplet>& in, Eigen::Index cols)
+{
+    // entries of the same position must be summed before squaring
+    std::vector<SparseTriplet> sorted(in);
+    std::sort(sorted.begin(), sorted.end(), [](const SparseTriplet& a, const SparseTriplet& b) {
+        return (a.col() != b.col()) ? (a.col() < b.col()) : (a.row() < b.row());
+    });
+
+    Eigen::Matrix<SolverContext::Param, Eigen::Dynamic, 1> norms = Eigen::Matrix<SolverContext::Param, Eigen::Dynamic, 1>::Zero(cols);
+    for (auto iter = sorted.cbegin(); iter != sorted.cend(); )
+    {
+        SolverContext::Param value = 0;
+        const auto row = iter->row();
+        const auto col = iter->col();
+
+        for (; iter != sorted.cend() && iter->row() == row && iter->col() == col; iter++)
+            value += iter->value();
+
+        norms(col) += value * value;
+    }
+
+    return norms;
+}
+
+// least squares (tall) or minimum norm (wide) solution of J*x = b, limited to a budget of iterations
+// columns are scaled to unit norm (jacobi preconditioner of J^t*J)
+// singular matrices are not detected - the solution of a conflicting system simply does not converge
+static bool IterativeSolve(const std::vector<SparseTriplet>& in, Eigen::Index rows, Eigen::Index cols, const Eigen::Matrix<SolverContext::Param, Eigen::Dynamic, 1>& b, Eigen::Matrix<SolverContext::Param, Eigen::Dynamic, 1>& out, size_t budget)
+{
+    using Param = SolverContext::Param;
+    using Vector = Eigen::Matrix<Param, Eigen::Dynamic, 1>;
+
+    const static Param tolerance = 1E-10; // relative to the initial residual of the normal equations
+
+    // preconditioner
+    Vector scale = ColumnsSquaredNormTriplets(in, cols);
+    for (Eigen::Index col = 0; col < cols; col++)
+        scale(col) = (scale(col) > 0) ? 1 / std::sqrt(scale(col)) : 1;
+
+    // solves for y = x / scale, starting from zero (so wide systems converge to the minimum norm solution)
+    Vector y = Vector::Zero(cols);
+    Vector r = b;           // residual b - J*x
+    Vector s(cols);         // residual of the normal equations, scale * J^t * r
+    Vector q(rows);         // J * scale * p
+    Vector t(cols);
+
+    MultiplyTransposedTriplets(in, r, s);
+    s.array() *= scale.array();
+
+    Vector p = s;
+    Param gamma = s.squaredNorm();
+    const Param limit = tolerance * tolerance * gamma;
+
+    for (size_t iter_count = 0; iter_count < budget && gamma > limit; iter_count++)
+    {
+        t = scale.cwiseProduct(p);
+        MultiplyTriplets(in, t, q);
+
+        const Param qq = q.squaredNorm();
+        if (qq == 0)
+            break;
+
+        const Param alpha = gamma / qq;
+        y += alpha * p;
+        r -= alpha * q;
+
+        MultiplyTransposedTriplets(in, r, s);
+        s.array() *= scale.array();
+
+        const Param gamma_new = s.squaredNorm();
+        p = s + (gamma_new / gamma) * p;
+        gamma = gamma_new;
+    }
+
+    out = scale.cwiseProduct(y);
+    return out.allFinite();
+}
+
+// WORKER POOL
+// Threads solving independent blocks of a sketch at the same time, or evaluating chunks of the equations of a single very large block
+// The workers are created once, on the first use, and wait for work in between
+// Work is split in tasks taken one after another by whichever thread is free, so a slow task does not hold the others back
+// ====================================================================================================
+// threads configured by the options
+static size_t Threads(const SketchSolverOptions& options)
+{
+    return (options.threads != 0) ? options.threads : std::max<unsigned int>(1, std::thread::hardware_concurrency());
+}
+
+class WorkerPool
+{
+public:
+    // runs body(task) for every task in [0, tasks), and returns once all are done - the calling thread works as well, along with threads - 1 workers at most
+    // if the pool is already busy (another solve running at the same time, or the blocks of this one), the tasks are simply run by the calling thread
+    static void Run(size_t tasks, size_t threads, const std::function<void(size_t)>& body)
+    {
+        WorkerPool& pool = Instance();
+
+        if (threads <= 1 || pool.bBusy.exchange(true))
+        {
+            for (size_t t = 0; t < tasks; t++)
+                body(t);
+
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(pool.mutex);
+
+            while (pool.workers.size() + 1 < threads)
+                pool.workers.emplace_back(&WorkerPool::Worker, &pool, pool.workers.size());
+
+            // the pool only grows, so it may hold more workers than this run was given - the others sit it out
+            pool.active = threads - 1;
+            pool.task = &body;
+            pool.next = 0;
+            pool.total = tasks;
+            pool.pending = tasks;
+            pool.generation++;
+        }
+
+        pool.wake.notify_all();
+        pool.Work();
+
+        {
+            std::unique_lock<std::mutex> lock(pool.mutex);
+            pool.done.wait(lock, [&pool]() { return pool.pending == 0; });
+        }
+
+        pool.bBusy = false;
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            bStop = true;
+        }
+
+        wake.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+protected:
+    WorkerPool() = default;
+
+    static WorkerPool& Instance()
+    {
+        static WorkerPool pool;
+        return pool;
+    }
+
+    std::atomic<bool> bBusy{false};     // one run at a time
+    std::mutex mutex;                   // guards all of the below
+    std::condition_variable wake;       // signals the workers a new run started (or to stop)
+    std::condition_variable done;       // signals the caller all tasks are done
+    std::vector<std::thread> workers;
+
+    const std::function<void(size_t)>* task = nullptr;
+    size_t next = 0;        // next task to be taken
+    size_t total = 0;       // tasks in this run
+    size_t pending = 0;     // tasks not yet finished
+    size_t generation = 0;  // increments on every run
+    size_t active = 0;      // workers taking part in this run (the ones with a lower index)
+    bool bStop = false;
+
+    // takes tasks until there are none left
+    void Work()
+    {
+        for (;;)
+        {
+            size_t index;
+            const std::function<void(size_t)>* body;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (next >= total)
+                    return;
+
+                index = next++;
+                body = task;
+            }
+
+            (*body)(index);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0)
+                done.notify_all();
+        }
+    }
+
+    void Worker(size_t index)
+    {
+        size_t seen = 0;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&]() { return bStop || generation != seen; });
+
+                if (bStop)
+                    return;
+
+                seen = generation;
+                if (index >= active)
+                    continue;
+            }
+
+            Work();
+        }
+    }
+};
+
+// NEWTON-RAPHSON
+// ====================================================================================================
+// SPARSE HESSIAN
+// Second derivatives of all the equations in a block - only the non-zero entries are stored
+// Each entry is keyed by the columns of both parameters in the jacobian
+class SparseHessian
+{
+public:
+    using Param = SolverContext::Param;
+    using Matrix = Eigen::Matrix<Param, Eigen::Dynamic, Eigen::Dynamic>;
+    using Vector = Eigen::Matrix<Param, Eigen::Dynamic, 1>;
+
+    struct Entry
+    {
+        unsigned int equation;  // row of the jacobian
+        unsigned int i;         // column of the first parameter
+        unsigned int j;         // column of the second parameter
+        Param derivative;       // d2F(equation)/d(i) d(j)
+    };
+
+    inline void clear() { entries.clear(); }
+    inline bool empty() const { return entries.empty(); }
+
+    // appends the entries of another hessian (of other equations of the same block)
+    void append(const SparseHessian& other)
+    {
+        entries.insert(entries.end(), other.entries.cbegin(), other.entries.cend());
+    }
+
+    // equations list each pair of parameters only once, but the hessian is symmetric
+    void add(unsigned int equation, unsigned int i, unsigned int j, Param derivative)
+    {
+        entries.push_back({equation, i, j, derivative});
+
+        if (i != j)
+            entries.push_back({equation, j, i, derivative});
+    }
+
+    // adds factor*(H*delta)^t to a (jacobian sized) matrix, where (H*delta)^t(k, i) = sum of d2F(k)/d(i) d(j) * delta(j)
+    // the cost is proportional to the number of entries, instead of parameters * parameters * equations
+    void MultiplyAdd(Param factor, const Vector& delta, Matrix& out) const
+    {
+        for (const Entry& e : entries)
+            out(e.equation, e.i) += factor * e.derivative * delta(e.j);
+    }
+
+    // same as above, but appended to the triplets of a sparse matrix (duplicates are summed when it is built)
+    void MultiplyAdd(Param factor, const Vector& delta, std::vector<SparseTriplet>& out) const
+    {
+        for (const Entry& e : entries)
+            out.emplace_back(e.equation, e.i, factor * e.derivative * delta(e.j));
+    }
+
+    // largest second order term of the equations along a step, 1/2 * delta^t * H(k) * delta - how much the linear model misses
+    Param MaxQuadratic(const Vector& delta, Eigen::Index rows) const
+    {
+        Vector terms = Vector::Zero(rows);
+        for (const Entry& e : entries)
+            terms(e.equation) += Param(0.5) * e.derivative * delta(e.i) * delta(e.j);
+
+        return (rows > 0) ? terms.cwiseAbs().maxCoeff() : 0;
+    }
+
+protected:
+    std::vector<Entry> entries;
+};
+
+class NewtonRaphson
+{
+public:
+    using Param = SolverContext::Param;
+    SolverContext& context;
+
+    virtual ~NewtonRaphson() = default;
+
+    NewtonRaphson(SolverContext& c, const SketchSolverOptions& options) :
+        context(c),
+        bIterative(context.size_parameters() > options.iterativeThreshold),
+        bSparse(bIterative || context.size_parameters() > options.sparseThreshold),
+        iterativeBudget(options.iterativeBudget),
+        statistics(options.statistics),
+        chunks(ParallelChunks(context.size_equations(), options)),
+        jacobian(bSparse ? 0 : context.size_equations(), bSparse ? 0 : context.size_parameters()),
+        sparse_jacobian(bSparse ? context.size_equations() : 0, bSparse ? context.size_parameters() : 0),
+        linear(options.decomposition),
+        equations(context.size_equations()),
+        parameters(context.size_parameters())
+    {
+        // map each parameter to it's column in the jacobian
+        table.reserve(context.size_parameters());
+        columns.reserve(context.size_parameters());
+        for (auto iter = context.cbegin_par(); iter != context.cend_par(); iter++)
+        {
+            columns.emplace(*iter, table.size());
+            table.push_back(*iter);
+        }
+
+        // derivatives by merged parameters accumulate on the column of their representative
+        for (auto iter = context.cbegin_ali(); iter != context.cend_ali(); iter++)
+        {
+            const unsigned int column = columns.at(iter->second);
+            columns.emplace(iter->first, column);
+            aliased.emplace_back(iter->first, column);
+        }
+
+        // the equations are indexed by their row, so each chunk of rows can be evaluated on it's own
+        rows.reserve(context.size_equations());
+        for (auto riter = context.cbegin_equ(); riter != context.cend_equ(); riter++)
+            rows.push_back(riter->get());
+
+        chunk_triplets.resize(chunks);
+        chunk_hessians.resize(chunks);
+
+        if (context.get_motion())
+            Weigh(*context.get_motion());
+    }
+
+    // prepares a solver kept from a previous solve of the same block (by a session) for solving it again
+    // the parameters and motion may have changed since, but not the equations - so the maps and matrices are all kept
+    virtual void Restart(const SketchSolverOptions& options)
+    {
+        statistics = options.statistics;
+
+        rowScale.resize(0);
+        columnScale.resize(0);
+        anchor.resize(0);
+        bAnchored = false;
+        bPulled = false;
+        steps = 0;
+
+        if (context.get_motion())
+            Weigh(*context.get_motion());
+    }
+
+    // limits the time of the next solve (or not, if null)
+    void Budget(const Deadline* d)
+    {
+        deadline = d;
+        bUnfinished = false;
+    }
+
+    // the last solve ran out of time before converging
+    inline bool unfinished() const { return bUnfinished; }
+
+    bool Iterate(size_t count = max_iter)
+    {
+        if (equations.rows() == 0 || parameters.rows() == 0)
+            return true; // empty system - nothing to do
+
+        // initialize state (parameters)
+        Resume();
+        ReadParameters();
+
+        // newton steps may increase the error (far from the solution) - the best iterate is kept, in case the time runs out
+        Eigen::Matrix<Param, Eigen::Dynamic, 1> best;
+        Param bestError = std::numeric_limits<Param>::infinity();
+
+        Param maxerror; // keep track of the error - used of stop criterion
+        for (size_t iter_count = 0; iter_count < count; iter_count++) {
+            if (!CalculateDelta(maxerror)) // cannot used richmond method on first step
+                return false;
+
+            if (deadline && maxerror < bestError)
+            {
+                best = parameters;
+                bestError = maxerror;
+            }
+
+            parameters += delta;
+
+            if (almost_zero(maxerror, tolerance))
+            {
+                #ifdef DEBUG_SKETCH_SOLVER
+                std::cout << "Converged by absolute error in iteration " << iter_count << std::endl;
+                #endif
+
+                // the last step is already computed - taking it costs nothing and squares the error left
+                // (which matters when solving subsystems in sequence: each one inherits the error of those before it)
+                // unless the step was pulled towards the anchors - then the constraints may not hold anymore
+                if (SaveParameters() < tolerance || !bPulled)
+                    return true; // stop iterations - solution reached
+
+                continue;
+            }
+
+            // the least squares solution of conflicting constraints also stops moving, and only factorizations detect that
+            if (SaveParameters() < tolerance && !bIterative)
+            {
+                #ifdef DEBUG_SKETCH_SOLVER
+                std::cout << "Converged by relative error in iteration " << iter_count << std::endl;
+                #endif
+
+                return true;
+            }
+
+            // out of time - the last step is only shown if it actually reduced the error
+            if (Expired())
+            {
+                Suspend((best.rows() == 0 || EvaluateValues(equations) < bestError) ? parameters : best);
+                return true;
+            }
+        }
+
+        #ifdef DEBUG_SKETCH_SOLVER
+        std::cout << "Exceeded maximum " << count << " iterations with error " << maxerror << std::endl;
+        #endif
+
+        return false;
+    }
+
+protected:
+    const bool bIterative; // very large blocks are solved matrix-free by conjugate gradients over the triplets
+    const bool bSparse; // large blocks are assembled from triplets and solved by sparse factorization
+    const size_t iterativeBudget; // maximum conjugate gradient iterations of each matrix-free solution
+    SketchSolverStatistics* statistics; // counters of the work done (optional)
+    const Deadline* deadline = nullptr; // time budget of the solve (optional)
+    bool bUnfinished = false; // the time budget ran out before converging
+    const size_t chunks; // rows are evaluated in this many chunks, in parallel (1 for small blocks, evaluated by the calling thread only)
+    std::vector<ConstraintEquation*> rows; // equation of each row
+    std::vector<std::vector<SparseTriplet>> chunk_triplets; // entries of the jacobian evaluated by each chunk, before they are gathered
+    std::vector<SparseHessian> chunk_hessians; // same for the hessian
+
+    // UNFINISHED SOLVE
+    // when the time runs out the sketch is left at the best iterate, but the method may have to go through worse ones to converge
+    // so the last iterate is kept, and the next solve continues from it instead - unless the sketch was changed in between (other than it's constant parameters)
+    Eigen::Matrix<Param, Eigen::Dynamic, 1> last;   // last iterate (unscaled), empty if the last solve finished
+    Eigen::Matrix<Param, Eigen::Dynamic, 1> shown;  // the values left in the sketch
+
+    // stops at the last iterate, leaving the given one in the sketch
+    void Suspend(const Eigen::Matrix<Param, Eigen::Dynamic, 1>& values)
+    {
+        last = (columnScale.rows() != 0) ? Eigen::Matrix<Param, Eigen::Dynamic, 1>(parameters.cwiseProduct(columnScale)) : parameters;
+
+        WriteParameters(values);
+        shown.resize(table.size());
+        for (unsigned int column = 0; column < table.size(); column++)
+            shown(column) = *table[column];
+    }
+
+    // continues from the last iterate of the previous solve, if it was suspended and the sketch still shows what it was left at
+    void Resume()
+    {
+        if (last.rows() == 0)
+            return;
+
+        bool bUnchanged = (last.rows() == Eigen::Index(table.size()));
+        for (unsigned int column = 0; bUnchanged && column < table.size(); column++)
+            bUnchanged = std::fabs(*table[column] - shown(column)) <= tolerance;
+
+        if (bUnchanged)
+        {
+            for (unsigned int column = 0; column < table.size(); column++)
+                *table[column] = last(column);
+
+            Propagate();
+        }
+
+        last.resize(0);
+        shown.resize(0);
+    }
+
+    // checks if the time budget ran out - the parameters are then left where they are
+    bool Expired()
+    {
+        if (!deadline || !deadline->expired())
+            return false;
+
+        #ifdef DEBUG_SKETCH_SOLVER
+        std::cout << "Time budget ran out after " << steps << " steps" << std::endl;
+        #endif
+
+        bUnfinished = true;
+        return true;
+    }
+
+    static size_t ParallelChunks(size_t equations, const SketchSolverOptions& options)
+    {
+        if (equations <= options.parallelThreshold)
+            return 1;
+
+        return std::max<size_t>(1, std::min(Threads(options), equations));
+    }
+
+    // runs body(chunk, begin, end) for chunks of consecutive rows [begin, end) covering all of them - in parallel, if there is more than one chunk
+    template<class Function>
+    void ForEachChunk(const Function& body) const
+    {
+        const size_t count = rows.size();
+        if (chunks <= 1)
+        {
+            body(0, 0, count);
+            return;
+        }
+
+        WorkerPool::Run(chunks, chunks, [&](size_t chunk) {
+            body(chunk, count * chunk / chunks, count * (chunk + 1) / chunks);
+        });
+    }
+    bool bLinear = false; // none of the equations has second derivatives - the step is never corrected
+
+    // PARAMETER TABLE
+    // the parameters are packed in the order of their columns, so reading and writing them is a walk over contiguous arrays
+    // they are still written to the sketch on every step - the equations are evaluated from there
+    std::vector<Param*> table;                                  // parameter of each column
+    std::vector<std::pair<Param*, unsigned int>> aliased;       // parameters merged by the presolve, and the column of their representative
+    std::unordered_map<const Param*, unsigned int> columns;     // column of the jacobian corresponding to each parameter (including the merged ones)
+
+    Eigen::Matrix<Param, Eigen::Dynamic, Eigen::Dynamic> jacobian; // functions on lines, derivatives on columns
+    SparseMatrix sparse_jacobian;                                  // same as above, used instead when bSparse is set
+    std::vector<SparseTriplet> triplets;                           // non-zero entries of the sparse jacobian
+    Eigen::Matrix<Param, Eigen::Dynamic, Eigen::Dynamic> corrected; // jacobian corrected by the second order terms J + 0.5*(H*delta)^t
+    SparseMatrix sparse_corrected;                                 // same as above, used instead when bSparse is set
+    std::vector<SparseTriplet> corrected_triplets;                 // non-zero entries of the sparse corrected jacobian
+    LinearSolver linear;                                           // factorization of J or of J + H*delta
+    SparseHessian hessian;                                         // Mijk = d2F(i)/d(j) d(k) for each equation, it's second derivatives with respect to all combinations of parameters
+
+    Eigen::Matrix<Param, Eigen::Dynamic, 1> equations;             // evaluation of functions (goal is to approach zero)
+    Eigen::Matrix<Param, Eigen::Dynamic, 1> parameters;            // current values of parameters
+    Eigen::Matrix<Param, Eigen::Dynamic, 1> delta;                 // correction for the iteration step
+
+    // EQUILIBRATION
+    // equations have different units (some are linear, some are squared lengths), so each one is divided by the norm of it's gradient
+    // the scaled error is then roughly the distance the geometry must still move, regardless of the kind of equation
+    // the scale is fixed for the whole solution (taken from the first jacobian), so all iterations minimize the same function
+    Eigen::Matrix<Param, Eigen::Dynamic, 1> rowScale;
+    Param tolerance = absError;     // distance error, but never below what can be represented at the magnitude of the coordinates
+
+    // WEIGHTED MOTION
+    // the block is solved for y = W^1/2 * x instead of x, where W are the weights (inertia) of the parameters
+    // the jacobian columns are divided by W^1/2, so the minimum norm step of y is the step of x with the least weighted movement
+    // only under-constrained blocks are affected - the step of a square or tall block is the same for any weights
+    Eigen::Matrix<Param, Eigen::Dynamic, 1> columnScale;    // W^-1/2, empty if not weighted
+    Eigen::Matrix<Param, Eigen::Dynamic, 1> anchor;         // anchors of the parameters (in y), or NaN where not anchored
+    Eigen::Matrix<Param, Eigen::Dynamic, 1> pull;           // from the parameters to the anchors (zero where not anchored)
+    Eigen::Matrix<Param, Eigen::Dynamic, 1> rhs;            // right hand side of the step
+    bool bAnchored = false;
+    bool bPulled = false;       // the last step was pulled towards the anchors
+    size_t steps = 0;           // first order steps solved
+
+    void Weigh(const SketchSolverMotion& motion)
+    {
+        if (motion.inertia.empty() && motion.anchors.empty())
+            return;
+
+        Eigen::Matrix<Param, Eigen::Dynamic, 1> weight = Eigen::Matrix<Param, Eigen::Dynamic, 1>::Zero(parameters.rows());
+        Eigen::Matrix<Param, Eigen::Dynamic, 1> anchored = Eigen::Matrix<Param, Eigen::Dynamic, 1>::Zero(parameters.rows());
+        Eigen::Matrix<Param, Eigen::Dynamic, 1> anchored_weight = Eigen::Matrix<Param, Eigen::Dynamic, 1>::Zero(parameters.rows());
+
+        // a column moves the representative and all of it's aliases together - it weighs as much as all of them
+        for (const auto& pair : columns)
+        {
+            const auto inertia = motion.inertia.find(const_cast<Param*>(pair.first));
+            const Param w = (inertia == motion.inertia.cend()) ? 1 : std::fmax(inertia->second, std::numeric_limits<Param>::epsilon());
+            weight(pair.second) += w;
+
+            const auto value = motion.anchors.find(const_cast<Param*>(pair.first));
+            if (value == motion.anchors.cend())
+                continue;
+
+            anchored(pair.second) += w * value->second;
+            anchored_weight(pair.second) += w;
+        }
+
+        columnScale = weight.cwiseSqrt().cwiseInverse();
+
+        anchor.resize(parameters.rows());
+        for (unsigned int column = 0; column < anchor.rows(); column++)
+        {
+            if (anchored_weight(column) == 0)
+            {
+                anchor(column) = std::numeric_limits<Param>::quiet_NaN();
+                continue;
+            }
+
+            anchor(column) = anchored(column) / anchored_weight(column) / columnScale(column);
+            bAnchored = true;
+        }
+    }
+
+    // samples all the parameters from the references in context
+    void ReadParameters()
+    {
+        for (unsigned int column = 0; column < table.size(); column++)
+            parameters(column) = *table[column];
+
+        // the precision of floating point is relative to the magnitude of the coordinates - very large sketches cannot reach absError
+        tolerance = std::fmax(absError, precision * parameters.cwiseAbs().maxCoeff());
+
+        if (columnScale.rows() != 0)
+            parameters.array() /= columnScale.array();
+    }
+
+    // updates the parameters on the sketch using current values in the vector, and returns the maximum distance between new-old
+    Param SaveParameters()
+    {
+        Param maxerror = 0;
+
+        for (unsigned int column = 0; column < table.size(); column++)
+        {
+            const Param value = (columnScale.rows() != 0) ? parameters(column) * columnScale(column) : parameters(column);
+
+            maxerror = std::fmax(maxerror, std::fabs(
+                *table[column] - value
+            ));
+
+            *table[column] = value;
+        }
+
+        Propagate();
+        return maxerror;
+    }
+
+    // updates the parameters on the sketch without changing the current values in the vector
+    void WriteParameters(const Eigen::Matrix<Param, Eigen::Dynamic, 1>& values)
+    {
+        for (unsigned int column = 0; column < table.size(); column++)
+            *table[column] = (columnScale.rows() != 0) ? values(column) * columnScale(column) : values(column);
+
+        Propagate();
+    }
+
+    // copies the value of each merged variable to all of it's aliases (same as the context does, without looking them up)
+    void Propagate()
+    {
+        for (const auto& pair : aliased)
+            *pair.first = *table[pair.second];
+    }
+
+    // solves J*delta = -F for the step
+    // if the previous step is provided, the jacobian is corrected by the second order terms (J + 0.5*(H*previous)^t)*delta = -F
+    // soft anchors (under-constrained blocks only): of all the steps solving the system, the one closest to the anchors is taken
+    // which is delta = pull + z, where z is the minimum norm solution of J*z = -F - J*pull
+    // only the first step of each solve is pulled (pulling every step could keep it from converging) - over many solves, as in a drag, the geometry settles on the anchors
+    bool SolveStep(const Eigen::Matrix<Param, Eigen::Dynamic, 1>* previous = NULL)
+    {
+        if (!previous)
+            steps++;
+
+        const bool bPull = bAnchored && steps == 1 && equations.rows() < parameters.rows();
+        if (bPull)
+            pull = (anchor - parameters).unaryExpr([](Param x) { return std::isnan(x) ? Param(0) : x; });
+
+        // a pull shorter than the tolerance cannot break the constraints
+        bPulled = bPull && (pull.array() * columnScale.array()).abs().maxCoeff() >= tolerance;
+
+        rhs = -equations;
+
+        bool bSolved;
+        if (bIterative)
+        {
+            // the jacobian is never assembled, products are computed from the triplets
+            const std::vector<SparseTriplet>* matrix = &triplets;
+            if (previous)
+            {
+                corrected_triplets = triplets;
+                hessian.MultiplyAdd(Param(0.5), *previous, corrected_triplets);
+                matrix = &corrected_triplets;
+            }
+
+            if (bPull)
+            {
+                Eigen::Matrix<Param, Eigen::Dynamic, 1> product(equations.rows());
+                MultiplyTriplets(*matrix, pull, product);
+                rhs -= product;
+            }
+
+            bSolved = IterativeSolve(*matrix, equations.rows(), parameters.rows(), rhs, delta, iterativeBudget);
+        }
+        else if (bSparse)
+        {
+            // large blocks are solved without inverting the jacobian
+            const SparseMatrix* matrix = &sparse_jacobian;
+            if (previous)
+            {
+                corrected_triplets = triplets;
+                hessian.MultiplyAdd(Param(0.5), *previous, corrected_triplets);
+                sparse_corrected.resize(sparse_jacobian.rows(), sparse_jacobian.cols());
+                sparse_corrected.setFromTriplets(corrected_triplets.cbegin(), corrected_triplets.cend());
+                matrix = &sparse_corrected;
+            }
+
+            if (bPull)
+                rhs -= (*matrix) * pull;
+
+            bSolved = SparseSolve(*matrix, rhs, delta);
+        }
+        else
+        {
+            const Eigen::Matrix<Param, Eigen::Dynamic, Eigen::Dynamic>* matrix = &jacobian;
+            if (previous)
+            {
+                corrected = jacobian;
+                hessian.MultiplyAdd(Param(0.5), *previous, corrected);
+                matrix = &corrected;
+            }
+
+            if (bPull)
+                rhs -= (*matrix) * pull;
+
+            bSolved = linear.Factorize(*matrix) && linear.Solve(rhs, delta);
+        }
+
+        if (bSolved && bPull)
+            delta += pull;
+
+        return bSolved;
+    }
+
+    // evaluates only the (scaled) equations at the parameters currently in the sketch, returns maximum error of the evaluated equations
+    Param EvaluateValues(Eigen::Matrix<Param, Eigen::Dynamic, 1>& out) const
+    {
+        out.resize(equations.rows());
+
+        ForEachChunk([&](size_t, size_t begin, size_t end) {
+            for (size_t row = begin; row < end; row++)
+                out(row) = rowScale(row) * rows[row]->current_value();
+        });
+
+        return (out.rows() > 0) ? out.cwiseAbs().maxCoeff() : 0;
+    }
+
+    // evaluates the equations and the jacobian at the current parameters, returns maximum error of the evaluated equations
+    Param Evaluate()
+    {
+        if (!bSparse)
+            jacobian.setZero();
+
+        // go over the rows (equations/functions) forming the sytem
+        ForEachChunk([&](size_t chunk, size_t begin, size_t end) {
+            std::vector<SparseTriplet>& out = (chunks > 1) ? chunk_triplets[chunk] : triplets;
+            out.clear();
+
+            for (size_t row = begin; row < end; row++)
+            {
+                // update value of equation
+                equations(row) = rows[row]->current_value();
+
+                // get gradient function (row)
+                const ConstraintEquationGradient grad = rows[row]->get_gradient();
+
+                // only the parameters listed in the gradient may have non-zero derivatives
+                for (const ConstraintEquationDerivative& der : grad)
+                {
+                    const auto column = columns.find(der.parameter);
+                    if (column == columns.cend())
+                        continue; // constant parameter - not a column of the jacobian
+
+                    // derivatives are accumulated because a parameter may be listed twice (for example, lines sharing an endpoint)
+                    if (bSparse)
+                        out.emplace_back(row, column->second, der.derivative);
+                    else
+                        jacobian(row, column->second) += der.derivative;
+                }
+            }
+        });
+
+        if (bSparse && chunks > 1)
+        {
+            triplets.clear();
+            for (const std::vector<SparseTriplet>& chunk : chunk_triplets)
+                triplets.insert(triplets.end(), chunk.cbegin(), chunk.cend());
+        }
+
+        // the scale is taken from the first jacobian
+        if (rowScale.rows() == 0)
+        {
+            rowScale = Eigen::Matrix<Param, Eigen::Dynamic, 1>::Zero(equations.rows());
+
+            if (bSparse)
+            {
+                // a parameter listed twice is counted as two entries - it's only a scale, so it does not need to be exact
+                for (const SparseTriplet& t : triplets)
+                    rowScale(t.row()) += t.value() * t.value();
+            }
+            else
+                rowScale = jacobian.rowwise().squaredNorm();
+
+            for (unsigned int r = 0; r < rowScale.rows(); r++)
+                rowScale(r) = (rowScale(r) > 0) ? 1 / std::sqrt(rowScale(r)) : 1; // an equation with no derivatives (degenerate geometry) is kept as is
+        }
+
+        equations.array() *= rowScale.array();
+
+        if (bSparse)
+        {
+            for (SparseTriplet& t : triplets)
+                t = SparseTriplet(t.row(), t.col(), t.value() * rowScale(t.row()) * ((columnScale.rows() != 0) ? columnScale(t.col()) : 1));
+        }
+        else if (columnScale.rows() != 0)
+            jacobian = rowScale.asDiagonal() * jacobian * columnScale.asDiagonal();
+        else
+            jacobian = rowScale.asDiagonal() * jacobian;
+
+        if (bSparse && !bIterative)
+            sparse_jacobian.setFromTriplets(triplets.cbegin(), triplets.cend()); // duplicates are summed
+
+        return equations.cwiseAbs().maxCoeff();
+    }
+
+    // calculates the correction for one iteration step, returns maximum error of the evaluated equations
+    bool CalculateDelta(Param& maxerror, bool bSecondOrder = true)
+    {
+        maxerror = Evaluate();
+
+        if (statistics)
+            statistics->steps++;
+
+        // first order step
+        if (!SolveStep())
+            return false;
+
+        // each refinement would be another run of conjugate gradients, so matrix-free solutions keep the first order step only
+        if (!bSecondOrder || bIterative || bLinear || !BuildHessian())
+        {
+            if (statistics)
+                statistics->secondOrderSkipped++;
+
+            return true;
+        }
+
+        // the second order terms are what the linear model misses along the step - if they are within the tolerance, correcting for them gains nothing
+        if (hessian.MaxQuadratic(delta, equations.rows()) < tolerance)
+        {
+            if (statistics)
+                statistics->secondOrderSkipped++;
+
+            return true;
+        }
+
+        if (statistics)
+            statistics->secondOrderCorrected++;
+
+        // internal (sub)iteration
+        // refine delta using second order terms
+        Param previous_change = std::numeric_limits<Param>::infinity();
+        for (size_t internalIterationCount = 0; internalIterationCount < max_iter; internalIterationCount++)
+        {
+            decltype(delta) old_delta = delta;
+            if (!SolveStep(&old_delta))
+            {
+                delta = old_delta;
+                break;
+            }
+
+            if (statistics)
+                statistics->secondOrderRefinements++;
+
+            const Param change = (delta - old_delta).lpNorm<1>();
+            if (change < relError)
+                break;
+
+            // each refinement costs another factorization - stop once they no longer converge quickly, and discard one that diverges
+            if (change > previous_change)
+            {
+                delta = old_delta;
+                break;
+            }
+
+            if (change > Param(0.5) * previous_change)
+                break;
+
+            previous_change = change;
+        }
+
+        return true;
+    }
+
+    // gathers the (scaled) second derivatives of all equations, returns false if there are none
+    bool BuildHessian()
+    {
+        ForEachChunk([&](size_t chunk, size_t begin, size_t end) {
+            SparseHessian& out = (chunks > 1) ? chunk_hessians[chunk] : hessian;
+            out.clear();
+
+            for (size_t k = begin; k < end; k++)
+            {
+                for (const ConstraintEquationSecondDerivative& der : rows[k]->get_hessian())
+                {
+                    const auto i = columns.find(der.p1);
+                    const auto j = columns.find(der.p2);
+
+                    if (i == columns.cend() || j == columns.cend())
+                        continue; // constant parameter - it's delta is always zero
+
+                    const Param scale = (columnScale.rows() != 0) ? rowScale(k) * columnScale(i->second) * columnScale(j->second) : rowScale(k);
+                    out.add(k, i->second, j->second, scale * der.derivative);
+                }
+            }
+        });
+
+        if (chunks > 1)
+        {
+            hessian.clear();
+            for (const SparseHessian& chunk : chunk_hessians)
+                hessian.append(chunk);
+        }
+
+        // equations either list their second derivatives or not, regardless of the parameters - if none did, no later step needs them either
+        bLinear = hessian.empty();
+        return !bLinear;
+    }
+};
+
+// TRUST REGION
+// Instead of always taking the full Newton step, the step is limited to a region where the linear model of the equations is trusted
+// Each step is only accepted if it actually reduces the error, otherwise the region shrinks and a shorter step is tried
+// ====================================================================================================
+class TrustRegion : public NewtonRaphson
+{
+public:
+    using Vector = Eigen::Matrix<Param, Eigen::Dynamic, 1>;
+
+    TrustRegion(SolverContext& c, const SketchSolverOptions& options) :
+        NewtonRaphson(c, options),
+        method(options.method)
+    {
+
+    }
+
+    bool Iterate(size_t count = max_iter)
+    {
+        if (equations.rows() == 0 || parameters.rows() == 0)
+            return true; // empty system - nothing to do
+
+        ReadParameters();
+
+        Param maxerror = Evaluate();
+        Param cost = 0.5 * equations.squaredNorm(); // the error minimized is 1/2 * |F|^2
+
+        if (almost_zero(maxerror, tolerance))
+            return true; // nothing to do - already solved
+
+        Param mu = 0;       // levenberg-marquardt damping
+        Param nu = 2;       // growth of damping on consecutive rejected steps
+        Param radius = 0;   // dogleg trust region radius (zero until the first step sets it)
+
+        if (method == SketchSolverMethod::LEVENBERG_MARQUARDT)
+            mu = 1E-3; // relative to the diagonal of J^t*J
+
+        for (size_t iter_count = 0; iter_count < count; iter_count++)
+        {
+            if (method == SketchSolverMethod::LEVENBERG_MARQUARDT)
+            {
+                if (!DampedStep(mu))
+                    return false;
+            }
+            else if (!DoglegStep(radius))
+                return false;
+
+            // a step too small to change the parameters means the error cannot be reduced any further (conflicting constraints)
+            const Param step = delta.norm();
+            if (step <= std::numeric_limits<Param>::epsilon() * (parameters.norm() + std::numeric_limits<Param>::epsilon()))
+            {
+                #ifdef DEBUG_SKETCH_SOLVER
+                std::cout << "Trust region stagnated in iteration " << iter_count << " with error " << maxerror << std::endl;
+                #endif
+
+                return false;
+            }
+
+            // reduction of the error predicted by the linear model, 1/2 * |F|^2 - 1/2 * |F + J*delta|^2
+            const Param predicted = cost - 0.5 * (equations + Multiply(delta)).squaredNorm();
+
+            // actual reduction of the error
+            trial = parameters + delta;
+            WriteParameters(trial);
+
+            EvaluateValues(trial_equations);
+            const Param trial_cost = 0.5 * trial_equations.squaredNorm();
+            const Param gain = (predicted > 0) ? (cost - trial_cost) / predicted : -1;
+
+            if (gain > 0 && std::isfinite(trial_cost))
+            {
+                // step accepted
+                parameters = trial;
+                maxerror = Evaluate();
+                cost = 0.5 * equations.squaredNorm();
+
+                if (almost_zero(maxerror, tolerance))
+                {
+                    #ifdef DEBUG_SKETCH_SOLVER
+                    std::cout << "Trust region converged in iteration " << iter_count << std::endl;
+                    #endif
+
+                    return true;
+                }
+
+                // good agreement with the model allows a larger step
+                mu *= std::fmax(Param(1)/3, 1 - std::pow(2*gain - 1, 3));
+                nu = 2;
+
+                if (gain > 0.75)
+                    radius = std::fmax(radius, 3 * step);
+                else if (gain < 0.25)
+                    radius = 0.5 * step;
+            }
+            else
+            {
+                // step rejected - restore the parameters and shorten the step
+                WriteParameters(parameters);
+
+                mu *= nu;
+                nu *= 2;
+                radius = 0.5 * step;
+            }
+
+            // out of time - only accepted steps reach the parameters, so they already are the best iterate
+            if (Expired())
+                return true;
+        }
+
+        #ifdef DEBUG_SKETCH_SOLVER
+        std::cout << "Exceeded maximum " << count << " iterations with error " << maxerror << std::endl;
+        #endif
+
+        return false;
+    }
+
+protected:
+    const SketchSolverMethod method;
+    Vector trial;           // parameters tested by the step
+    Vector trial_equations; // evaluation of functions at the tested parameters
+
+    // J*x
+    Vector Multiply(const Vector& x) const
+    {
+        if (bIterative)
+        {
+            Vector out(equations.rows());
+            MultiplyTriplets(triplets, x, out);
+            return out;
+        }
+
+        if (bSparse)
+            return sparse_jacobian * x;
+
+        return jacobian * x;
+    }
+
+    // gradient of the error 1/2 * |F|^2, which is J^t*F
+    Vector Gradient() const
+    {
+        if (bIterative)
+        {
+            Vector out(parameters.rows());
+            MultiplyTransposedTriplets(triplets, equations, out);
+            return out;
+        }
+
+        if (bSparse)
+            return sparse_jacobian.transpose() * equations;
+
+        return jacobian.transpose() * equations;
+    }
+
+    // diagonal of J^t*J
+    Vector ColumnsSquaredNorm() const
+    {
+        if (bIterative)
+            return ColumnsSquaredNormTriplets(triplets, parameters.rows());
+
+        if (!bSparse)
+            return jacobian.colwise().squaredNorm().transpose();
+
+        Vector norms(sparse_jacobian.cols());
+        for (int col = 0; col < sparse_jacobian.cols(); col++)
+            norms(col) = sparse_jacobian.col(col).squaredNorm();
+
+        return norms;
+    }
+
+    // levenberg-marquardt step (J^t*J + mu*D)*delta = -J^t*F, where D is the diagonal of J^t*J (so each parameter is damped according to it's own scale)
+    // it is solved as the least squares problem [J; sqrt(mu*D)]*delta = [-F; 0] to avoid squaring the condition number
+    bool DampedStep(Param mu)
+    {
+        const auto rows = equations.rows();
+        const auto cols = parameters.rows();
+        const Vector damping = (mu * ColumnsSquaredNorm().array().max(std::numeric_limits<Param>::epsilon())).sqrt().matrix();
+
+        Vector rhs = Vector::Zero(rows + cols);
+        rhs.head(rows) = -equations;
+
+        if (bSparse)
+        {
+            corrected_triplets = triplets;
+            for (int col = 0; col < cols; col++)
+                corrected_triplets.emplace_back(rows + col, col, damping(col));
+
+            if (bIterative)
+                return IterativeSolve(corrected_triplets, rows + cols, cols, rhs, delta, iterativeBudget);
+
+            sparse_corrected.resize(rows + cols, cols);
+            sparse_corrected.setFromTriplets(corrected_triplets.cbegin(), corrected_triplets.cend());
+
+            return SparseSolve(sparse_corrected, rhs, delta);
+        }
+
+        corrected.resize(rows + cols, cols);
+        corrected.topRows(rows) = jacobian;
+        corrected.bottomRows(cols) = damping.asDiagonal();
+
+        return linear.Factorize(corrected) && linear.Solve(rhs, delta);
+    }
+
+    // powell's dogleg step: the gauss-newton step if it fits the region, otherwise a path between it and the steepest descent step
+    bool DoglegStep(Param& radius)
+    {
+        const Vector gradient = Gradient();
+        const Param gradient_norm = gradient.norm();
+
+        // steepest descent step, minimizing the linear model along the gradient
+        const Param curvature = Multiply(gradient).squaredNorm();
+        if (gradient_norm == 0 || curvature == 0)
+            return false; // the error cannot be reduced (stationary point)
+
+        const Vector descent = (-gradient_norm * gradient_norm / curvature) * gradient;
+        const Param descent_norm = descent.norm();
+
+        // gauss-newton step (the same as newton-raphson without the second order terms)
+        const bool bNewton = SolveStep();
+        const Param newton_norm = bNewton ? delta.norm() : 0;
+
+        if (radius == 0)
+            radius = bNewton ? newton_norm : descent_norm; // the first full step is always tried
+
+        if (bNewton && newton_norm <= radius)
+            return true; // delta already holds the gauss-newton step
+
+        if (!bNewton || descent_norm >= radius)
+        {
+            if (descent_norm >= radius)
+                delta = (-radius / gradient_norm) * gradient;
+            else
+                delta = descent;
+
+            return true;
+        }
+
+        // intersection of the segment from descent to newton with the border of the region: |descent + beta*(newton - descent)| = radius
+        const Vector segment = delta - descent;
+        const Param a = segment.squaredNorm();
+        const Param b = descent.dot(segment);
+        const Param c = descent_norm * descent_norm - radius * radius; // negative, descent step is inside the region
+        const Param root = std::sqrt(b * b - a * c);
+        const Param beta = (b <= 0) ? (root - b) / a : -c / (b + root);
+
+        delta = descent + beta * segment;
+        return true;
+    }
+};
+
+// QUASI-NEWTON
+// The jacobian is evaluated and factorized only once, and then approximated by rank-1 (Broyden) updates from the change of the equations on each step
+// The updates are applied to the inverse (Sherman-Morrison), so solving the step reuses the same factorization: x = (I + u_k*s_k^t) ... (I + u_1*s_1^t) * J0^-1 * b
+// The jacobian is evaluated and factorized again only when the approximation stops converging
+// ====================================================================================================
+class QuasiNewton : public NewtonRaphson
+{
+public:
+    using Vector = Eigen::Matrix<Param, Eigen::Dynamic, 1>;
+
+    QuasiNewton(SolverContext& c, const SketchSolverOptions& options) :
+        NewtonRaphson(c, options)
+    {
+
+    }
+
+    // the factorization and it's updates are kept for the next solve, as the geometry changes little from one solve to the next (the frames of a drag)
+    // they are only dropped if the weights of the motion changed - the scaled jacobian they approximate would be another
+    void Restart(const SketchSolverOptions& options)
+    {
+        const Vector previousRowScale = rowScale;
+        const Vector previousColumnScale = columnScale;
+
+        NewtonRaphson::Restart(options);
+
+        bFactorized = bFactorized && columnScale.rows() == previousColumnScale.rows() && (columnScale.rows() == 0 || columnScale == previousColumnScale);
+        if (bFactorized)
+            rowScale = previousRowScale;
+    }
+
+    bool Iterate(size_t count = max_iter)
+    {
+        // a failed solve may leave the factorization of a jacobian far from any solution - the next one starts afresh
+        const bool bSolved = Steps(count);
+        if (!bSolved)
+            bFactorized = false;
+
+        return bSolved;
+    }
+
+protected:
+    bool Steps(size_t count)
+    {
+        if (equations.rows() == 0 || parameters.rows() == 0)
+            return true; // empty system - nothing to do
+
+        Resume();
+        ReadParameters();
+
+        // the factorization kept from the previous solve is tried first - refreshed below as soon as it stalls
+        Param maxerror;
+        if (bFactorized)
+            maxerror = EvaluateValues(equations);
+        else
+        {
+            maxerror = Evaluate();
+            if (!Factorize())
+                return false;
+        }
+
+        // the approximate steps may increase the error - the best iterate is kept, in case the time runs out
+        Vector best = parameters;
+        Param bestError = maxerror;
+
+        for (size_t iter_count = 0; iter_count < count; iter_count++)
+        {
+            if (almost_zero(maxerror, tolerance))
+            {
+                #ifdef DEBUG_SKETCH_SOLVER
+                std::cout << "Quasi-Newton converged in iteration " << iter_count << " after " << factorizations << " factorizations" << std::endl;
+                #endif
+
+                return true;
+            }
+
+            if (!ApplyInverse(-equations, delta))
+                return false;
+
+            parameters += delta;
+            WriteParameters(parameters);
+
+            // change of the equations caused by the step
+            change = -equations;
+            const Param previous = maxerror;
+
+            maxerror = EvaluateValues(equations);
+            change += equations;
+
+            if (!std::isfinite(maxerror))
+                return false;
+
+            if (maxerror < bestError)
+            {
+                best = parameters;
+                bestError = maxerror;
+            }
+
+            // out of time - left at the best iterate
+            if (Expired())
+            {
+                Suspend((bestError < maxerror) ? best : parameters);
+                return true;
+            }
+
+            // stalled - the approximation is no longer good enough (or has been updated too many times)
+            if (maxerror > stall * previous || updates.size() >= max_updates)
+            {
+                maxerror = Evaluate();
+                if (!Factorize())
+                    return false;
+
+                continue;
+            }
+
+            // broyden's update of the inverse: H = (I + u*s^t) * H  where  u = (s - H*y) / (s^t * H * y)
+            if (!ApplyInverse(change, inverse_change))
+                return false;
+
+            const Param denominator = delta.dot(inverse_change);
+            if (std::fabs(denominator) <= std::numeric_limits<Param>::epsilon() * delta.squaredNorm())
+            {
+                maxerror = Evaluate();
+                if (!Factorize())
+                    return false;
+
+                continue;
+            }
+
+            updates.push_back({(delta - inverse_change) / denominator, delta});
+        }
+
+        #ifdef DEBUG_SKETCH_SOLVER
+        std::cout << "Exceeded maximum " << count << " iterations with error " << maxerror << std::endl;
+        #endif
+
+        return false;
+    }
+
+    const static size_t max_updates = 10; // the factorization is refreshed after these many updates, as the approximation drifts
+    constexpr static Param stall = 0.5;   // each step must at least halve the error, otherwise the jacobian is refreshed
+
+    struct Update
+    {
+        Vector u;
+        Vector s;
+    };
+
+    std::vector<Update> updates;
+    bool bFactorized = false; // the factorization and the updates can be applied - made by this solve, or kept from the previous one
+    SparseLinearSolver sparse_linear;
+    Vector change;          // y = F(x + s) - F(x)
+    Vector inverse_change;  // H*y
+    size_t factorizations = 0;
+
+    // factorizes the jacobian evaluated at the current parameters, discarding all updates
+    bool Factorize()
+    {
+        updates.clear();
+        factorizations++;
+
+        if (statistics)
+            statistics->steps++;
+
+        if (bIterative)
+            bFactorized = true; // never factorized - the triplets are kept instead
+        else if (bSparse)
+            bFactorized = sparse_linear.Factorize(sparse_jacobian);
+        else
+            bFactorized = linear.Factorize(jacobian);
+
+        return bFactorized;
+    }
+
+    // solves J*out = b using the factorization and the updates
+    bool ApplyInverse(const Vector& b, Vector& out)
+    {
+        bool bResult;
+        if (bIterative)
+            bResult = IterativeSolve(triplets, equations.rows(), parameters.rows(), b, out, iterativeBudget);
+        else if (bSparse)
+            bResult = sparse_linear.Solve(b, out);
+        else
+            bResult = linear.Solve(b, out);
+
+        for (const Update& update : updates)
+            out += update.u * update.s.dot(out);
+
+        return bResult && out.allFinite();
+    }
+};
+
+// CLOSED FORM
+// A block of a single equation does not need any matrix - the minimum norm step is along the gradient: delta = -F * g / |g|^2
+// If the equation is linear on the free parameters (LineHorizontal, PointsCoincidentAxis, PointOnMidpoint...), a single step is the exact solution
+// Otherwise (a distance on one free point, for example) the same step converges quadratically, like Newton-Raphson
+// Not all equations list their second derivatives, so instead of trusting the hessian the solution is always checked on the next evaluation
+// ====================================================================================================
+static bool SolveSingleEquation(SolverContext& block)
+{
+    using Param = SolverContext::Param;
+    ConstraintEquation& equ = *block.cbegin_equ()->get();
+
+    // same tolerance as the other solvers, error is the distance to satisfy the equation
+    Param tolerance = absError;
+    for (auto iter = block.cbegin_par(); iter != block.cend_par(); iter++)
+        tolerance = std::fmax(tolerance, precision * std::fabs(*(*iter)));
+
+    // weighted motion, same as the other solvers: the step is delta = pull - F' * W^-1 * g / (g^t * W^-1 * g), where F' = F + g.pull
+    // a merged parameter weighs as much as all of it's aliases
+    std::map<Param*, Param> weight;                     // W, of the parameters solved for (1 if not listed)
+    std::map<Param*, std::pair<Param, Param>> anchored; // sum of weight * anchor, and of weight, of the anchored ones
+    if (const SketchSolverMotion* motion = block.get_motion())
+    {
+        auto add = [&](Param* p, Param* representative) {
+            const auto inertia = motion->inertia.find(p);
+            const Param w = (inertia == motion->inertia.cend()) ? 1 : std::fmax(inertia->second, std::numeric_limits<Param>::epsilon());
+            weight[representative] += w;
+
+            const auto value = motion->anchors.find(p);
+            if (value == motion->anchors.cend())
+                return;
+
+            auto& sum = anchored[representative];
+            sum.first += w * value->second;
+            sum.second += w;
+        };
+
+        for (auto iter = block.cbegin_par(); iter != block.cend_par(); iter++)
+            add(*iter, *iter);
+
+        for (auto iter = block.cbegin_ali(); iter != block.cend_ali(); iter++)
+            add(iter->first, iter->second);
+    }
+
+    std::map<Param*, Param> gradient; // a parameter may be listed more than once
+    std::map<Param*, Param> pull;
+    for (size_t iter_count = 0; iter_count < max_iter; iter_count++)
+    {
+        gradient.clear();
+        for (const ConstraintEquationDerivative& der : equ.get_gradient())
+            if (block.contains(block.resolve(der.parameter)))
+                gradient[block.resolve(der.parameter)] += der.derivative;
+
+        Param norm = 0;
+        Param weighted_norm = 0;
+        for (const auto& pair : gradient)
+        {
+            const auto w = weight.find(pair.first);
+            norm += pair.second * pair.second;
+            weighted_norm += pair.second * pair.second / ((w == weight.cend()) ? 1 : w->second);
+        }
+
+        const Param value = equ.current_value();
+        if (!std::isfinite(value))
+            return false;
+
+        // no free parameter moves the equation (all merged or constant) - it either holds already, or cannot be satisfied
+        if (norm == 0)
+            return almost_zero(value, tolerance);
+
+        // value expected after moving to the anchors (only the first step is pulled, same as the other solvers)
+        Param pulled = value;
+        Param max_pull = 0;
+        pull.clear();
+        for (const auto& pair : anchored)
+        {
+            const auto g = gradient.find(pair.first);
+            if (g == gradient.cend() || iter_count > 0)
+                continue;
+
+            const Param p = pair.second.first / pair.second.second - *pair.first;
+            pull[pair.first] = p;
+            pulled += g->second * p;
+            max_pull = std::fmax(max_pull, std::fabs(p));
+        }
+
+        const Param distance = value / std::sqrt(norm);
+        if (almost_zero(distance, tolerance) && almost_zero(max_pull, tolerance))
+            return true;
+
+        for (auto& pair : gradient)
+        {
+            const auto w = weight.find(pair.first);
+            const auto p = pull.find(pair.first);
+            *pair.first += ((p == pull.cend()) ? 0 : p->second) - pulled * pair.second / ((w == weight.cend()) ? 1 : w->second) / weighted_norm;
+        }
+
+        block.Propagate();
+    }
+
+    return false;
+}
+
+// CONSTRUCTIVE PLAN
+// A well-constrained block (as many equations as parameters) is usually built like ruler and compass drawings:
+// once some parameters are known (constant, or already placed), a few equations determine a few more parameters (a point from two distances, for example)
+// Those small rigid clusters are found from the graph of equations and parameters, and solved one after another, each by a tiny local Newton-Raphson
+// If the plan gets stuck (a cluster larger than maxCluster is needed) or a cluster fails, the whole block is solved by the numeric methods as before
+// ====================================================================================================
+class ConstructivePlan
+{
+public:
+    using Param = SolverContext::Param;
+    using Matrix = Eigen::Matrix<Param, Eigen::Dynamic, Eigen::Dynamic>;
+    using Vector = Eigen::Matrix<Param, Eigen::Dynamic, 1>;
+
+    const static size_t maxCluster = 4; // largest number of parameters placed at once (two points)
+
+    ConstructivePlan(SolverContext& c) :
+        context(c),
+        linear(SketchSolverDecomposition::AUTOMATIC)
+    {
+        // index the parameters
+        for (auto iter = context.cbegin_par(); iter != context.cend_par(); iter++)
+        {
+            index.emplace(*iter, unknowns.size());
+            unknowns.push_back(*iter);
+        }
+
+        param_equations.resize(unknowns.size());
+        placed.assign(unknowns.size(), false);
+
+        // index the equations and which parameters they depend on
+        for (auto riter = context.begin_equ(); riter != context.end_equ(); riter++)
+        {
+            std::vector<unsigned int> params;
+            for (const ConstraintEquationDerivative& der : riter->get()->get_gradient())
+            {
+                auto iter = index.find(context.resolve(der.parameter));
+                if (iter != index.cend() && std::find(params.cbegin(), params.cend(), iter->second) == params.cend())
+                    params.push_back(iter->second);
+            }
+
+            for (unsigned int p : params)
+                param_equations[p].push_back(equations.size());
+
+            unplaced.push_back(params.size());
+            equation_params.push_back(std::move(params));
+            equations.push_back(riter->get());
+        }
+
+        tolerance = absError;
+        for (const Param* p : unknowns)
+            tolerance = std::fmax(tolerance, precision * std::fabs(*p));
+    }
+
+    // places all the parameters, cluster after cluster - if no plan was found or it failed, the parameters are restored and returns false
+    bool Solve()
+    {
+        std::vector<Param> initial;
+        for (const Param* p : unknowns)
+            initial.push_back(*p);
+
+        if (Place())
+            return true;
+
+        for (unsigned int p = 0; p < unknowns.size(); p++)
+            *unknowns[p] = initial[p];
+
+        context.Propagate();
+        return false;
+    }
+
+protected:
+    SolverContext& context;
+    LinearSolver linear;
+    Param tolerance;
+
+    std::map<const Param*, unsigned int> index;
+    std::vector<Param*> unknowns;
+    std::vector<bool> placed;
+
+    std::vector<ConstraintEquation*> equations;
+    std::vector<std::vector<unsigned int>> equation_params;    // free parameters of each equation
+    std::vector<std::vector<unsigned int>> param_equations;    // equations depending on each parameter
+    std::vector<size_t> unplaced;                              // number of parameters of each equation not yet placed
+
+    bool Place()
+    {
+        // equations with few parameters left to place are the candidates to start a cluster
+        std::list<unsigned int> candidates;
+        for (unsigned int e = 0; e < equations.size(); e++)
+            if (unplaced[e] > 0 && unplaced[e] <= maxCluster)
+                candidates.push_back(e);
+
+        size_t placed_count = 0;
+        while (placed_count < unknowns.size())
+        {
+            bool bProgress = false;
+
+            for (auto candidate = candidates.begin(); candidate != candidates.end(); )
+            {
+                if (unplaced[*candidate] == 0)
+                {
+                    candidate = candidates.erase(candidate); // already placed by another cluster
+                    continue;
+                }
+
+                // cluster: the parameters still unplaced by the candidate, and all equations depending only on them (and on placed parameters)
+                std::vector<unsigned int> cluster_params;
+                for (unsigned int p : equation_params[*candidate])
+                    if (!placed[p])
+                        cluster_params.push_back(p);
+
+                std::vector<unsigned int> cluster_equations;
+                for (unsigned int p : cluster_params)
+                {
+                    for (unsigned int e : param_equations[p])
+                    {
+                        if (std::find(cluster_equations.cbegin(), cluster_equations.cend(), e) != cluster_equations.cend())
+                            continue;
+
+                        const bool bInside = std::all_of(equation_params[e].cbegin(), equation_params[e].cend(), [&](unsigned int q) {
+                            return placed[q] || std::find(cluster_params.cbegin(), cluster_params.cend(), q) != cluster_params.cend();
+                        });
+
+                        if (bInside)
+                            cluster_equations.push_back(e);
+                    }
+                }
+
+                // not rigid yet - it may become so after other parameters are placed
+                if (cluster_equations.size() < cluster_params.size())
+                {
+                    candidate++;
+                    continue;
+                }
+
+                if (!SolveCluster(cluster_params, cluster_equations))
+                    return false;
+
+                // place the parameters and update the equations depending on them
+                for (unsigned int p : cluster_params)
+                {
+                    placed[p] = true;
+                    placed_count++;
+
+                    for (unsigned int e : param_equations[p])
+                        if (--unplaced[e] > 0 && unplaced[e] <= maxCluster)
+                            candidates.push_back(e);
+                }
+
+                bProgress = true;
+                candidate = candidates.erase(candidate);
+            }
+
+            if (!bProgress)
+            {
+                #ifdef DEBUG_SKETCH_SOLVER
+                std::cout << "Constructive plan stuck with " << (unknowns.size() - placed_count) << " parameters left" << std::endl;
+                #endif
+
+                return false;
+            }
+        }
+
+        // equations fully determined by different clusters were never solved - they must hold as well
+        for (ConstraintEquation* equ : equations)
+            if (!almost_zero(Distance(*equ), tolerance))
+                return false;
+
+        return true;
+    }
+
+    // value of the equation divided by the norm of it's gradient, roughly the distance to satisfy it
+    Param Distance(ConstraintEquation& equ) const
+    {
+        Param norm = 0;
+        for (const ConstraintEquationDerivative& der : equ.get_gradient())
+            norm += der.derivative * der.derivative;
+
+        return (norm > 0) ? equ.current_value() / std::sqrt(norm) : equ.current_value();
+    }
+
+    // local Newton-Raphson on the parameters of the cluster, all others are constant
+    bool SolveCluster(const std::vector<unsigned int>& params, const std::vector<unsigned int>& cluster)
+    {
+        Matrix jacobian(cluster.size(), params.size());
+        Vector values(cluster.size());
+        Vector delta;
+
+        for (size_t iter_count = 0; iter_count < max_iter; iter_count++)
+        {
+            jacobian.setZero();
+
+            Param maxerror = 0;
+            for (unsigned int row = 0; row < cluster.size(); row++)
+            {
+                ConstraintEquation& equ = *equations[cluster[row]];
+                Param norm = 0;
+
+                for (const ConstraintEquationDerivative& der : equ.get_gradient())
+                {
+                    norm += der.derivative * der.derivative;
+
+                    const auto iter = index.find(context.resolve(der.parameter));
+                    if (iter == index.cend())
+                        continue;
+
+                    const auto column = std::find(params.cbegin(), params.cend(), iter->second);
+                    if (column != params.cend())
+                        jacobian(row, column - params.cbegin()) += der.derivative;
+                }
+
+                // equilibrated, same as the numeric solvers
+                const Param scale = (norm > 0) ? 1 / std::sqrt(norm) : 1;
+                jacobian.row(row) *= scale;
+                values(row) = scale * equ.current_value();
+                maxerror = std::fmax(maxerror, std::fabs(values(row)));
+            }
+
+            // the error of each cluster is inherited by all clusters placed after it, so once converged one more step is taken (it's quadratic)
+            const bool bConverged = almost_zero(maxerror, tolerance);
+
+            if (!linear.Factorize(jacobian) || !linear.Solve(-values, delta))
+                return bConverged;
+
+            for (unsigned int column = 0; column < params.size(); column++)
+                *unknowns[params[column]] += delta(column);
+
+            context.Propagate();
+
+            if (bConverged)
+                return true;
+        }
+
+        return false;
+    }
+};
+
+// STRUCTURE
+// Dulmage-Mendelsohn decomposition of a block, from which parameters appear in which equations (not from their values)
+// A maximum matching pairs each equation to a distinct parameter it determines:
+// - equations left unmatched, and all equations reachable from them by alternating paths, are the structurally over-determined part
+// - parameters left unmatched, and all parameters reachable from them, are the structurally under-determined part
+// If all are matched (perfect matching), the equations form a directed graph: an equation depends on the equations determining the other parameters it uses
+// It's strongly connected components are square subsystems, in block triangular order - each one can be solved once all components it depends on are solved
+// ====================================================================================================
+class StructuralDecomposition
+{
+public:
+    using Param = SolverContext::Param;
+
+    constexpr static unsigned int none = std::numeric_limits<unsigned int>::max();
+
+    StructuralDecomposition(const SolverContext& context)
+    {
+        // index the parameters
+        std::map<const Param*, unsigned int> index;
+        for (auto iter = context.cbegin_par(); iter != context.cend_par(); iter++)
+        {
+            index.emplace(*iter, unknowns.size());
+            unknowns.push_back(*iter);
+        }
+
+        // index which parameters each equation depends on
+        for (auto riter = context.cbegin_equ(); riter != context.cend_equ(); riter++)
+        {
+            std::vector<unsigned int> params;
+            for (const ConstraintEquationDerivative& der : riter->get()->get_gradient())
+            {
+                auto iter = index.find(context.resolve(der.parameter));
+                if (iter != index.cend() && std::find(params.cbegin(), params.cend(), iter->second) == params.cend())
+                    params.push_back(iter->second);
+            }
+
+            equation_params.push_back(std::move(params));
+        }
+
+        param_equations.resize(unknowns.size());
+        for (unsigned int e = 0; e < equation_params.size(); e++)
+            for (unsigned int p : equation_params[e])
+                param_equations[p].push_back(e);
+
+        Match();
+        Reach();
+
+        if (IsWellDetermined())
+            Components();
+    }
+
+    inline bool IsWellDetermined() const { return overdetermined == 0 && underdetermined == 0; }
+
+    inline size_t size_overdetermined() const { return overdetermined; }    // equations in the over-determined part
+    inline size_t size_underdetermined() const { return underdetermined; }  // parameters in the under-determined part
+    inline size_t size_subsystems() const { return subsystems.size(); }     // square subsystems (only if well-determined)
+
+    // moves the equations of the context into one context per subsystem, in the order they must be solved
+    void Split(SolverContext& context, std::list<SolverContext>& dst) const
+    {
+        std::vector<std::vector<Param*>> subsystem_parameters;
+        subsystem_parameters.reserve(subsystems.size());
+
+        for (const std::vector<unsigned int>& subsystem : subsystems)
+        {
+            subsystem_parameters.emplace_back();
+            for (unsigned int e : subsystem)
+                subsystem_parameters.back().push_back(unknowns[equation_match[e]]);
+        }
+
+        context.SequenceSplit(subsystems, subsystem_parameters, dst);
+    }
+
+protected:
+    std::vector<Param*> unknowns;
+    std::vector<std::vector<unsigned int>> equation_params;    // free parameters of each equation
+    std::vector<std::vector<unsigned int>> param_equations;    // equations depending on each parameter
+
+    std::vector<unsigned int> equation_match;   // parameter determined by each equation (or none)
+    std::vector<unsigned int> param_match;      // equation determining each parameter (or none)
+
+    size_t overdetermined = 0;
+    size_t underdetermined = 0;
+
+    std::vector<std::vector<unsigned int>> subsystems;  // equations of each strongly connected component, dependencies first
+
+    // maximum matching by augmenting paths, started from a greedy matching (which, for sketches, already matches almost everything)
+    void Match()
+    {
+        equation_match.assign(equation_params.size(), none);
+        param_match.assign(unknowns.size(), none);
+
+        for (unsigned int e = 0; e < equation_params.size(); e++)
+        {
+            for (unsigned int p : equation_params[e])
+            {
+                if (param_match[p] != none)
+                    continue;
+
+                equation_match[e] = p;
+                param_match[p] = e;
+                break;
+            }
+        }
+
+        std::vector<unsigned int> visited(unknowns.size(), none);
+        for (unsigned int e = 0; e < equation_params.size(); e++)
+            if (equation_match[e] == none)
+                Augment(e, visited);
+    }
+
+    // depth first search (with an explicit stack - chains of equations may be very long) for an alternating path ending on an unmatched parameter
+    bool Augment(unsigned int root, std::vector<unsigned int>& visited)
+    {
+        std::vector<std::pair<unsigned int, size_t>> stack; // equation, and the position of the next parameter to explore
+        stack.push_back({root, 0});
+
+        while (!stack.empty())
+        {
+            const unsigned int e = stack.back().first;
+            if (stack.back().second == equation_params[e].size())
+            {
+                stack.pop_back();
+                continue;
+            }
+
+            const unsigned int p = equation_params[e][stack.back().second++];
+            if (visited[p] == root)
+                continue;
+
+            visited[p] = root;
+            if (param_match[p] != none)
+            {
+                stack.push_back({param_match[p], 0}); // try to move the equation determining p to some other parameter
+                continue;
+            }
+
+            // found - each equation on the path takes the parameter it was exploring
+            for (const auto& step : stack)
+            {
+                const unsigned int q = equation_params[step.first][step.second - 1];
+                equation_match[step.first] = q;
+                param_match[q] = step.first;
+            }
+
+            return true;
+        }
+
+        return false;
+    }
+
+    // sizes of the over and under-determined parts, reached by alternating paths from the unmatched equations and parameters
+    void Reach()
+    {
+        std::vector<bool> reached(equation_params.size(), false);
+        std::vector<unsigned int> queue;
+
+        for (unsigned int e = 0; e < equation_params.size(); e++)
+            if (equation_match[e] == none)
+            {
+                reached[e] = true;
+                queue.push_back(e);
+            }
+
+        while (!queue.empty())
+        {
+            const unsigned int e = queue.back();
+            queue.pop_back();
+            overdetermined++;
+
+            for (unsigned int p : equation_params[e])
+            {
+                const unsigned int next = param_match[p]; // matched, otherwise the matching would not be maximum
+                if (next != none && !reached[next])
+                {
+                    reached[next] = true;
+                    queue.push_back(next);
+                }
+            }
+        }
+
+        reached.assign(unknowns.size(), false);
+        for (unsigned int p = 0; p < unknowns.size(); p++)
+            if (param_match[p] == none)
+            {
+                reached[p] = true;
+                queue.push_back(p);
+            }
+
+        while (!queue.empty())
+        {
+            const unsigned int p = queue.back();
+            queue.pop_back();
+            underdetermined++;
+
+            for (unsigned int e : param_equations[p])
+            {
+                const unsigned int next = equation_match[e];
+                if (next != none && !reached[next])
+                {
+                    reached[next] = true;
+                    queue.push_back(next);
+                }
+            }
+        }
+    }
+
+    // strongly connected components (tarjan, with an explicit stack)
+    // a component is only completed after all components it depends on, so they are found already in the order to be solved
+    void Components()
+    {
+        const unsigned int count = equation_params.size();
+        std::vector<unsigned int> order(count, none);
+        std::vector<unsigned int> lowlink(count, none);
+        std::vector<bool> onstack(count, false);
+        std::vector<unsigned int> component;
+        std::vector<std::pair<unsigned int, size_t>> stack; // equation, and the position of the next parameter to explore
+        unsigned int counter = 0;
+
+        for (unsigned int root = 0; root < count; root++)
+        {
+            if (order[root] != none)
+                continue;
+
+            order[root] = lowlink[root] = counter++;
+            component.push_back(root);
+            onstack[root] = true;
+            stack.push_back({root, 0});
+
+            while (!stack.empty())
+            {
+                const unsigned int e = stack.back().first;
+                if (stack.back().second < equation_params[e].size())
+                {
+                    // e depends on the equation determining each of it's parameters
+                    const unsigned int next = param_match[equation_params[e][stack.back().second++]];
+                    if (next == e)
+                        continue;
+
+                    if (order[next] == none)
+                    {
+                        order[next] = lowlink[next] = counter++;
+                        component.push_back(next);
+                        onstack[next] = true;
+                        stack.push_back({next, 0});
+                    }
+                    else if (onstack[next])
+                        lowlink[e] = std::min(lowlink[e], order[next]);
+
+                    continue;
+                }
+
+                stack.pop_back();
+                if (!stack.empty())
+                    lowlink[stack.back().first] = std::min(lowlink[stack.back().first], lowlink[e]);
+
+                if (lowlink[e] != order[e])
+                    continue;
+
+                // e is the root of a component
+                subsystems.emplace_back();
+                unsigned int member;
+                do {
+                    member = component.back();
+                    component.pop_back();
+                    onstack[member] = false;
+                    subsystems.back().push_back(member);
+                } while (member != e);
+            }
+        }
+    }
+};
+
+// DEGREES OF FREEDOM
+// The rank of the jacobian tells how many of the equations are independent (locally, at the current geometry)
+// A new equation is dependent on a block if adding it does not increase the rank - then it either repeats a constraint (redundant) or contradicts it (conflicting)
+// Either way the jacobian of the block becomes singular, so it can be rejected without running any iterations
+// ====================================================================================================
+const static SolverContext::Param rankTolerance = 1.5E-8; // about sqrt(epsilon) - pivots (of the equilibrated jacobian) below this are dependent
+
+// rank of the jacobian of all equations in a context, evaluated at the current parameters
+static size_t JacobianRank(const SolverContext& context, const SketchSolverOptions& options)
+{
+    using Param = SolverContext::Param;
+
+    std::map<const Param*, unsigned int> columns;
+    unsigned int column = 0;
+    for (auto iter = context.cbegin_par(); iter != context.cend_par(); column++, iter++)
+        columns.emplace(*iter, column);
+
+    // each row is scaled to unit norm, so equations of different units are comparable
+    std::vector<SparseTriplet> triplets;
+    unsigned int row = 0;
+    for (auto riter = context.cbegin_equ(); riter != context.cend_equ(); row++, riter++)
+    {
+        const size_t first = triplets.size();
+        Param norm = 0;
+
+        for (const ConstraintEquationDerivative& der : riter->get()->get_gradient())
+        {
+            const auto column = columns.find(der.parameter);
+            if (column == columns.cend())
+                continue;
+
+            triplets.emplace_back(row, column->second, der.derivative);
+            norm += der.derivative * der.derivative;
+        }
+
+        if (norm > 0)
+            for (size_t i = first; i < triplets.size(); i++)
+                triplets[i] = SparseTriplet(triplets[i].row(), triplets[i].col(), triplets[i].value() / std::sqrt(norm));
+    }
+
+    SparseMatrix jacobian(context.size_equations(), context.size_parameters());
+    jacobian.setFromTriplets(triplets.cbegin(), triplets.cend());
+
+    if (context.size_parameters() > options.sparseThreshold)
+    {
+        Eigen::SparseQR<SparseMatrix, Eigen::COLAMDOrdering<int>> qr;
+        qr.setPivotThreshold(rankTolerance);
+        qr.compute(jacobian);
+        return qr.rank();
+    }
+
+    const Eigen::Matrix<Param, Eigen::Dynamic, Eigen::Dynamic> dense = jacobian;
+    Eigen::ColPivHouseholderQR<Eigen::Matrix<Param, Eigen::Dynamic, Eigen::Dynamic>> qr(dense);
+    qr.setThreshold(rankTolerance);
+    return qr.rank();
+}
+
+// classifies new equations one after another, each against the blocks of the sketch and the equations classified before it
+// the sketch is split only once - each equation is then added to the block it shares parameters with (joining the blocks it connects)
+// the rank of each block is kept, so classifying an equation only computes the rank of the block it was added to
+class Classifier
+{
+public:
+    using Param = SolverContext::Param;
+
+    // the constraint excluded (optional) is left out of the blocks, so it can be classified again against the others
+    Classifier(Sketch& sketch, const SketchSolverOptions& o, const SketchConstraint* excluded = nullptr) :
+        options(o)
+    {
+        SolverContext::BlockSplit(excluded ? SolverContext(sketch, *excluded) : SolverContext(sketch), blocks);
+
+        for (SolverContext& block : blocks)
+            for (auto iter = block.cbegin_par(); iter != block.cend_par(); iter++)
+                owner[*iter] = &block;
+    }
+
+    SketchConstraintStatus Add(std::unique_ptr<ConstraintEquation>&& candidate)
+    {
+        if (!candidate)
+            return SketchConstraintStatus::INDEPENDENT;
+
+        const ConstraintEquationGradient grad = candidate->get_gradient();
+
+        Param norm = 0;
+        for (const ConstraintEquationDerivative& der : grad)
+            norm += der.derivative * der.derivative;
+
+        // the blocks sharing parameters with the new equation (the only ones affected)
+        std::vector<SolverContext*> shared;
+        for (const ConstraintEquationDerivative& der : grad)
+        {
+            const auto iter = owner.find(der.parameter);
+            if (iter != owner.cend() && std::find(shared.cbegin(), shared.cend(), iter->second) == shared.cend())
+                shared.push_back(iter->second);
+        }
+
+        // does not share any parameter with the other constraints - a block of it's own
+        if (shared.empty())
+        {
+            blocks.emplace_back(std::move(candidate));
+            Own(blocks.back());
+            return SketchConstraintStatus::INDEPENDENT;
+        }
+
+        // the new equation joins blocks that were independent until now - the rank of the joined block is the sum of theirs
+        SolverContext& affected = *shared.front();
+        size_t rank = 0;
+        for (SolverContext* block : shared)
+        {
+            rank += Rank(*block);
+            if (block == &affected)
+                continue;
+
+            ranks.erase(block);
+            affected.splice(*block);
+            blocks.remove_if([block](const SolverContext& test) { return &test == block; });
+        }
+
+        const Param residual = candidate->current_value();
+        affected.add(std::move(candidate));
+        Own(affected);
+
+        // the geometry is degenerate (for example, distance of coincident points), so the rank is meaningless - leave it to the solver
+        if (norm == 0)
+        {
+            ranks.erase(&affected);
+            return SketchConstraintStatus::INDEPENDENT;
+        }
+
+        const size_t newRank = Rank(affected, true);
+        if (newRank > rank)
+            return SketchConstraintStatus::INDEPENDENT;
+
+        const Param value = residual / std::sqrt(norm); // roughly the distance from satisfying it
+        return almost_zero(value, absError) ? SketchConstraintStatus::REDUNDANT : SketchConstraintStatus::CONFLICTING;
+    }
+
+protected:
+    const SketchSolverOptions& options;
+    std::list<SolverContext> blocks;
+    std::unordered_map<const Param*, SolverContext*> owner;   // block of each parameter
+    std::unordered_map<const SolverContext*, size_t> ranks;     // of the blocks already computed
+
+    void Own(SolverContext& block)
+    {
+        for (auto iter = block.cbegin_par(); iter != block.cend_par(); iter++)
+            owner[*iter] = &block;
+    }
+
+    size_t Rank(const SolverContext& block, bool bChanged = false)
+    {
+        auto iter = ranks.find(&block);
+        if (iter == ranks.end())
+            iter = ranks.emplace(&block, JacobianRank(block, options)).first;
+        else if (bChanged)
+            iter->second = JacobianRank(block, options);
+
+        return iter->second;
+    }
+};
+
+SketchConstraintStatus SketchSolver::Classify(Sketch& sketch, SketchConstraint& constraint, const SketchSolverOptions& options)
+{
+    return Classifier(sketch, options).Add( std::unique_ptr<ConstraintEquation>(constraint.GetEquation()) );
+}
+
+SketchConstraintStatus SketchSolver::Classify(Sketch& sketch, const std::vector<std::unique_ptr<SketchConstraint>>& constraints, const SketchSolverOptions& options)
+{
+    Classifier classifier(sketch, options);
+
+    for (const std::unique_ptr<SketchConstraint>& constraint : constraints)
+    {
+        const SketchConstraintStatus status = classifier.Add( std::unique_ptr<ConstraintEquation>(constraint->GetEquation()) );
+        if (status != SketchConstraintStatus::INDEPENDENT)
+            return status;
+    }
+
+    return SketchConstraintStatus::INDEPENDENT;
+}
+
+std::vector<SketchComponentDOF> SketchSolver::DegreesOfFreedom(Sketch& sketch, const SketchSolverOptions& options)
+{
+    std::list<SolverContext> blocks;
+    SolverContext context(sketch);
+    SolverContext::BlockSplit(std::move(context), blocks);
+
+    std::vector<SketchComponentDOF> result;
+    result.reserve(blocks.size());
+
+    for (const SolverContext& block : blocks)
+    {
+        StructuralDecomposition structure(block);
+        result.push_back({block.size_parameters(), block.size_equations(), JacobianRank(block, options), structure.size_overdetermined(), structure.size_underdetermined()});
+    }
+
+    return result;
+}
+
+// SOLVER
+// ====================================================================================================
+// solves a block by the method in the options
+static bool SolveNumeric(SolverContext& block, const SketchSolverOptions& options)
+{
+    if (block.size_equations() == 1)
+        return SolveSingleEquation(block);
+
+    switch (options.method)
+    {
+        case SketchSolverMethod::NEWTON_RAPHSON:    return NewtonRaphson(block, options).Iterate();
+        case SketchSolverMethod::BROYDEN:           return QuasiNewton(block, options).Iterate();
+        default:                                    return TrustRegion(block, options).Iterate();
+    }
+}
+
+// one block of the sketch, along with the numeric solver built for it
+// sessions keep the blocks between solves, so the solver (and all of it's workspaces) is only built once
+struct SolverBlock
+{
+    SolverContext context;
+    std::unique_ptr<NewtonRaphson> solver; // by the method in the options, built on the first numeric solve
+    bool bUnfinished = false; // the time budget of the last solve ran out before it converged (or before it was started at all)
+
+    SolverBlock(SolverContext&& c) : context(std::move(c)) { }
+};
+
+// splits the sketch into blocks
+static void SplitBlocks(SolverContext&& context, std::list<SolverBlock>& blocks)
+{
+    std::list<SolverContext> split;
+
+    if (context.size_equations() > 1)
+        SolverContext::BlockSplit(std::move(context), split);
+    else
+        split.emplace_back( std::move(context) );
+
+    for (SolverContext& block : split)
+        blocks.emplace_back( std::move(block) );
+
+    #ifdef DEBUG_SKETCH_SOLVER
+    std::cout << "Sketch divided into " << blocks.size() << " blocks" << std::endl;
+    #endif
+}
+
+// same as above, reusing the solver of the block if it was already built, within the time budget
+static bool SolveNumeric(SolverBlock& block, const SketchSolverOptions& options, const Deadline& deadline)
+{
+    if (block.context.size_equations() == 1)
+        return SolveSingleEquation(block.context);
+
+    if (block.solver)
+        block.solver->Restart(options);
+
+    bool bSolved;
+    switch (options.method)
+    {
+        case SketchSolverMethod::NEWTON_RAPHSON:
+            if (!block.solver)
+                block.solver.reset(new NewtonRaphson(block.context, options));
+
+            block.solver->Budget(&deadline);
+            bSolved = block.solver->Iterate();
+            break;
+
+        case SketchSolverMethod::BROYDEN:
+            if (!block.solver)
+                block.solver.reset(new QuasiNewton(block.context, options));
+
+            block.solver->Budget(&deadline);
+            bSolved = static_cast<QuasiNewton&>(*block.solver).Iterate();
+            break;
+
+        default:
+            if (!block.solver)
+                block.solver.reset(new TrustRegion(block.context, options));
+
+            block.solver->Budget(&deadline);
+            bSolved = static_cast<TrustRegion&>(*block.solver).Iterate();
+            break;
+    }
+
+    block.bUnfinished = bSolved && block.solver->unfinished();
+    return bSolved;
+}
+
+// solves a well-determined block as a sequence of square subsystems, in block triangular order
+// if there is only one subsystem, or any of them fails, the parameters are restored and returns false
+static bool SolveTriangular(SolverContext& block, const SketchSolverOptions& options)
+{
+    StructuralDecomposition structure(block);
+    if (structure.size_subsystems() < 2)
+        return false;
+
+    #ifdef DEBUG_SKETCH_SOLVER
+    std::cout << "Block divided into " << structure.size_subsystems() << " subsystems" << std::endl;
+    #endif
+
+    std::vector<std::pair<SolverContext::Param*, SolverContext::Param>> initial;
+    for (auto iter = block.cbegin_par(); iter != block.cend_par(); iter++)
+        initial.push_back({*iter, *(*iter)});
+
+    std::list<SolverContext> sequence;
+    structure.Split(block, sequence);
+
+    bool bSolved = true;
+    for (SolverContext& subsystem : sequence)
+        if (!(bSolved = SolveNumeric(subsystem, options)))
+            break;
+
+    // return the equations to the block
+    for (SolverContext& subsystem : sequence)
+        block.splice(subsystem);
+
+    if (bSolved)
+        return true;
+
+    for (auto& pair : initial)
+        *pair.first = pair.second;
+
+    block.Propagate();
+    return false;
+}
+
+// checks if a block is already solved: all of it's equations hold, within the tolerance the solver converges to (each one scaled by it's gradient, as the solver does)
+// and none of it's parameters is away from it's anchor (the solver would pull it there, even if the equations hold)
+// costs one evaluation of the values and gradients, without any matrix
+static bool IsSettled(const SolverContext& block)
+{
+    using Param = SolverContext::Param;
+
+    Param magnitude = 0;
+    for (auto iter = block.cbegin_par(); iter != block.cend_par(); iter++)
+        magnitude = std::fmax(magnitude, std::fabs(*(*iter)));
+
+    const Param tolerance = std::fmax(absError, precision * magnitude);
+
+    for (auto iter = block.cbegin_equ(); iter != block.cend_equ(); iter++)
+    {
+        // only the derivatives by the parameters solved for - same as the (equilibrated) rows of the jacobian
+        Param norm = 0;
+        for (const ConstraintEquationDerivative& der : iter->get()->get_gradient())
+            if (block.contains(block.resolve(der.parameter)))
+                norm += der.derivative * der.derivative;
+
+        const Param value = std::fabs(iter->get()->current_value());
+        if (!(value <= tolerance * ((norm > 0) ? std::sqrt(norm) : 1)))
+            return false;
+    }
+
+    const SketchSolverMotion* motion = block.get_motion();
+    if (!motion || motion->anchors.empty())
+        return true;
+
+    auto away = [motion, tolerance](SolverContext::Param* p) -> bool {
+        auto anchor = motion->anchors.find(p);
+        return anchor != motion->anchors.cend() && !(std::fabs(*p - anchor->second) < tolerance);
+    };
+
+    for (auto iter = block.cbegin_par(); iter != block.cend_par(); iter++)
+        if (away(*iter))
+            return false;
+
+    for (auto iter = block.cbegin_ali(); iter != block.cend_ali(); iter++)
+        if (away(iter->first))
+            return false;
+
+    return true;
+}
+
+// solves one block, by the fastest method it allows
+// blocks that already hold (untouched by the last change to the sketch) are left as they are
+// so are the blocks reached after the time budget ran out - they are solved by a later call
+static bool SolveBlock(SolverBlock& block, const SketchSolverOptions& options, const Deadline& deadline)
+{
+    SolverContext& context = block.context;
+    block.bUnfinished = false;
+
+    if (IsSettled(context))
+        return true;
+
+    // out of time before even starting - left as it is, for the next solve
+    if (deadline.expired())
+    {
+        block.bUnfinished = true;
+        return true;
+    }
+
+    context.Presolve();
+
+    if (context.size_equations() > 1 && context.size_equations() == context.size_parameters())
+    {
+        if (options.bConstructive && ConstructivePlan(context).Solve())
+            return true;
+
+        if (options.bTriangular && SolveTriangular(context, options))
+            return true;
+    }
+
+    return SolveNumeric(block, options, deadline);
+}
+
+// the blocks share no parameters, so they can be solved at the same time, each by one thread
+// the largest blocks are started first, so the small ones fill in the gaps at the end (instead of a large one starting last, alone)
+// returns false as soon as any block fails, the blocks not yet started are not solved at all
+static bool SolveConcurrently(std::list<SolverBlock>& blocks, const SketchSolverOptions& options, const Deadline& deadline)
+{
+    std::vector<SolverBlock*> order;
+    for (SolverBlock& block : blocks)
+        order.push_back(&block);
+
+    std::stable_sort(order.begin(), order.end(), [](const SolverBlock* a, const SolverBlock* b) {
+        if (a->bUnfinished != b->bUnfinished)
+            return a->bUnfinished; // see SolveSketch
+
+        return a->context.size_equations() > b->context.size_equations();
+    });
+
+    // the counters are not shared between threads - each block counts it's own, added up at the end
+    std::vector<SketchSolverStatistics> statistics(options.statistics ? order.size() : 0);
+    std::atomic<bool> bFailed(false);
+
+    WorkerPool::Run(order.size(), Threads(options), [&](size_t index) {
+        if (bFailed)
+            return;
+
+        SketchSolverOptions local = options;
+        if (options.statistics)
+            local.statistics = &statistics[index];
+
+        if (!SolveBlock(*order[index], local, deadline))
+            bFailed = true;
+    });
+
+    for (const SketchSolverStatistics& block : statistics)
+    {
+        options.statistics->steps += block.steps;
+        options.statistics->secondOrderSkipped += block.secondOrderSkipped;
+        options.statistics->secondOrderCorrected += block.secondOrderCorrected;
+        options.statistics->secondOrderRefinements += block.secondOrderRefinements;
+    }
+
+    return !bFailed;
+}
+
+// counts the blocks the time budget ran out on - skipped, or left at the best iterate
+static void CountUnfinished(const std::list<SolverBlock>& blocks, const SketchSolverOptions& options)
+{
+    if (!options.statistics)
+        return;
+
+    for (const SolverBlock& block : blocks)
+        if (block.bUnfinished)
+            options.statistics->unfinished++;
+}
+
+static bool SolveSketch(std::list<SolverBlock>& blocks, const SketchSolverOptions& options)
+{
+    // the blocks the last solve ran out of time on (kept by a session) are solved first, in the same order
+    // otherwise checking all the blocks before them (settled or not) could use up the budget of every solve, and they would never be reached
+    std::list<SolverBlock> unfinished;
+    for (auto block = blocks.begin(); block != blocks.end(); )
+    {
+        auto next = std::next(block);
+        if (block->bUnfinished)
+            unfinished.splice(unfinished.end(), blocks, block);
+
+        block = next;
+    }
+
+    blocks.splice(blocks.begin(), unfinished);
+
+    const Deadline deadline(options);
+
+    // many blocks, adding up to enough work to be worth sharing it among threads
+    size_t equations = 0;
+    for (const SolverBlock& block : blocks)
+        equations += block.context.size_equations();
+
+    if (blocks.size() > 1 && equations > options.parallelThreshold && Threads(options) > 1)
+    {
+        if (SolveConcurrently(blocks, options, deadline))
+        {
+            CountUnfinished(blocks, options);
+            return true;
+        }
+
+        // all or nothing - every block is rolled back, solved or not (those not solved yet are not changed)
+        for (SolverBlock& block : blocks)
+            block.context.RollBack();
+
+        return false;
+    }
+
+    for (auto block = blocks.begin(); block != blocks.end(); block++)
+    {
+        if (SolveBlock(*block, options, deadline))
+            continue; // solution success
+
+        // failed - must roll back all previous blocks (in reverse order)
+        for(;;block--)
+        {
+            block->context.RollBack();
+
+            if (block == blocks.begin())
+                break;
+        }
+
+        return false;
+    }
+
+    CountUnfinished(blocks, options);
+    return true;
+}
+
+bool SketchSolver::Solve(Sketch& sketch, const SketchSolverOptions& options, const std::vector<Param*>& constantParameters, const SketchSolverMotion* motion)
+{
+    std::list<SolverBlock> blocks;
+    SplitBlocks(SolverContext(sketch, constantParameters, motion), blocks);
+
+    return SolveSketch(blocks, options);
+}
+
+bool SketchSolver::SolveWith(Sketch& sketch, const std::vector<std::unique_ptr<SketchConstraint>>& constraints, const SketchSolverOptions& options)
+{
+    SolverContext context(sketch);
+    for (const std::unique_ptr<SketchConstraint>& constraint : constraints)
+    {
+        ConstraintEquation* equ = constraint->GetEquation();
+        if (equ)
+            context.add(std::unique_ptr<ConstraintEquation>( equ ));
+    }
+
+    std::list<SolverBlock> blocks;
+    SplitBlocks(std::move(context), blocks);
+
+    return SolveSketch(blocks, options);
+}
+
+// CONTINUATION
+// A target far from the current geometry (a dimension edited to a very different value) may be out of reach of Newton's method, which diverges
+// Instead the target is moved there in steps, each solved starting from the solution of the previous one (which is close, if the step is small)
+// The first step goes all the way, so easy edits cost the same as before - a step that fails is halved, and each one that succeeds is doubled
+// It runs on the caller's thread, so giving up is kept cheap: an edit conflicting with the other constraints is given up after the first step,
+// a step still failing at an eighth of the change is taken as diverging, and the number of solves is bounded
+// ====================================================================================================
+const static SolverContext::Param minContinuationStep = 1.0 / 8; // smallest fraction of the change attempted before giving up
+const static unsigned int maxContinuationSolves = 12; // of all the steps, whether they succeed or fail
+
+bool SketchSolver::SolveContinuation(Sketch& sketch, SketchConstraint& constraint, Param& target, Param value, const SketchSolverOptions& options, SketchSolverSession* session)
+{
+    const Param start = target;
+
+    // only used to roll back the steps already taken, if the target is never reached (the solver changes nothing but the coordinates)
+    std::vector<Param> snapshot;
+    snapshot.reserve(2 * sketch.points.size());
+    for (const SketchPoint& p : sketch.points)
+    {
+        snapshot.push_back(p.x);
+        snapshot.push_back(p.y);
+    }
+
+    auto rollBack = [&]() -> bool {
+        target = start;
+
+        auto saved = snapshot.cbegin();
+        for (SketchPoint& p : sketch.points)
+        {
+            p.x = *saved++;
+            p.y = *saved++;
+        }
+
+        if (session)
+            session->Changed(sketch, constraint);
+
+        return false;
+    };
+
+    Param reached = 0; // fraction of the change already solved
+    Param step = 1;
+    for (unsigned int solves = 0; reached < 1; solves++)
+    {
+        if (solves == maxContinuationSolves)
+            return rollBack();
+
+        const Param next = std::fmin(1, reached + step);
+        target = start + next * (value - start);
+
+        // the equations keep a copy of the values they depend on - those of the blocks the constraint is in are built again
+        if (session)
+            session->Changed(sketch, constraint);
+
+        // a failed solve is rolled back to the previous step
+        if (session ? session->Solve(sketch, options) : Solve(sketch, options))
+        {
+            reached = next;
+            step *= 2;
+            continue;
+        }
+
+        #ifdef DEBUG_SKETCH_SOLVER
+        std::cout << "Continuation step of " << step << " failed at " << reached << std::endl;
+        #endif
+
+        // the constraint is not independent of the others (over-constrained) - no step is small enough for them to agree on a new value
+        if (solves == 0 && Classifier(sketch, options, &constraint).Add( std::unique_ptr<ConstraintEquation>(constraint.GetEquation()) ) != SketchConstraintStatus::INDEPENDENT)
+            return rollBack();
+
+        step /= 2;
+        if (step < minContinuationStep)
+            return rollBack();
+    }
+
+    return true;
+}
+
+// SESSION
+// ====================================================================================================
+struct SketchSolverSession::Cache
+{
+    size_t revision;                    // of the constraints the blocks were built from
+    std::vector<Param*> constants;      // constant parameters the blocks were built without
+    SketchSolverOptions options;        // the solvers of the blocks depend on them
+    std::list<SolverBlock> blocks;
+    std::unordered_map<const Param*, SolverBlock*> owner; // block of each parameter (including the merged ones)
+
+    // maps the parameters of a block to it
+    void Own(SolverBlock& block)
+    {
+        for (auto iter = block.context.cbegin_par(); iter != block.context.cend_par(); iter++)
+            owner[*iter] = &block;
+
+        for (auto iter = block.context.cbegin_ali(); iter != block.context.cend_ali(); iter++)
+            owner[iter->first] = &block;
+    }
+};
+
+// the options the solvers are built for (the others can change between solves)
+static bool SameConfiguration(const SketchSolverOptions& a, const SketchSolverOptions& b)
+{
+    return a.method == b.method &&
+        a.decomposition == b.decomposition &&
+        a.sparseThreshold == b.sparseThreshold &&
+        a.iterativeThreshold == b.iterativeThreshold &&
+        a.iterativeBudget == b.iterativeBudget &&
+        a.parallelThreshold == b.parallelThreshold &&
+        a.threads == b.threads;
+}
+
+SketchSolverSession::SketchSolverSession() = default;
+SketchSolverSession::~SketchSolverSession() = default;
+
+SketchSolverSession::SketchSolverSession(SketchSolverSession&& other)
+{
+    other.Invalidate();
+}
+
+SketchSolverSession& SketchSolverSession::operator=(SketchSolverSession&& other)
+{
+    Invalidate();
+    other.Invalidate();
+    return *this;
+}
+
+void SketchSolverSession::Invalidate()
+{
+    cache.reset();
+}
+
+bool SketchSolverSession::Solve(Sketch& sketch, const SketchSolverOptions& options, const std::vector<Param*>& constantParameters, const SketchSolverMotion* motion)
+{
+    if (!cache || cache->revision != sketch.constraints.revision() || cache->constants != constantParameters || !SameConfiguration(cache->options, options))
+    {
+        #ifdef DEBUG_SKETCH_SOLVER
+        std::cout << "Solver session rebuilt" << std::endl;
+        #endif
+
+        cache.reset(new Cache());
+        cache->revision = sketch.constraints.revision();
+        cache->constants = constantParameters;
+        cache->options = options;
+
+        SplitBlocks(SolverContext(sketch, constantParameters), cache->blocks);
+
+        for (SolverBlock& block : cache->blocks)
+            cache->Own(block);
+    }
+
+    for (SolverBlock& block : cache->blocks)
+        block.context.Rebase(motion);
+
+    return SolveSketch(cache->blocks, options);
+}
+
+void SketchSolverSession::Changed(Sketch& sketch, SketchConstraint& constraint)
+{
+    if (!cache || cache->revision != sketch.constraints.revision())
+        return; // out of date anyway - rebuilt on the next solve
+
+    std::unique_ptr<ConstraintEquation> changed(constraint.GetEquation());
+
+    // the blocks keeping the equation of the constraint
+    std::vector<const SolverBlock*> stale;
+    auto isStale = [this, &stale](ConstraintEquation& equ) -> bool {
+        for (const ConstraintEquationDerivative& der : equ.get_gradient())
+        {
+            auto iter = cache->owner.find(der.parameter);
+            if (iter != cache->owner.end() && std::find(stale.cbegin(), stale.cend(), iter->second) != stale.cend())
+                return true;
+        }
+
+        return false;
+    };
+
+    if (changed)
+        for (const ConstraintEquationDerivative& der : changed->get_gradient())
+        {
+            auto iter = cache->owner.find(der.parameter);
+            if (iter != cache->owner.end() && std::find(stale.cbegin(), stale.cend(), iter->second) == stale.cend())
+                stale.push_back(iter->second);
+        }
+
+    if (stale.empty())
+    {
+        cache.reset(); // depends on constants only - rebuilt on the next solve
+        return;
+    }
+
+    // the equations of those blocks are built again (with the new value) - the other blocks are kept as they are
+    std::unique_ptr<SolverContext> context;
+    for (const std::unique_ptr<SketchConstraint>& other : sketch.constraints)
+    {
+        std::unique_ptr<ConstraintEquation> equ( other.get() == &constraint ? changed.release() : other->GetEquation() );
+        if (!equ || !isStale(*equ))
+            continue;
+
+        if (context)
+            context->add(std::move(equ), cache->constants);
+        else
+            context.reset(new SolverContext(std::move(equ), cache->constants));
+    }
+
+    cache->blocks.remove_if([&stale](const SolverBlock& test) -> bool {
+        return std::find(stale.cbegin(), stale.cend(), &test) != stale.cend();
+    });
+
+    // the new blocks have the same parameters as the ones removed, so they replace all of their owners
+    std::list<SolverBlock> rebuilt;
+    SplitBlocks(std::move(*context), rebuilt);
+
+    for (SolverBlock& block : rebuilt)
+        cache->Own(block);
+
+    cache->blocks.splice(cache->blocks.end(), rebuilt);
+}
+
+void SketchSolverSession::Added(const Sketch& sketch, size_t revision, SketchConstraint& constraint)
+{
+    if (!cache || cache->revision != revision)
+    {
+        cache.reset(); // it was already out of date - rebuilt on the next solve
+        return;
+    }
+
+    cache->revision = sketch.constraints.revision();
+
+    ConstraintEquation* equ = constraint.GetEquation();
+    if (!equ)
+        return;
+
+    std::unique_ptr<ConstraintEquation> equation(equ);
+
+    // the blocks sharing parameters with the new equation become one
+    std::vector<SolverBlock*> merged;
+    for (const ConstraintEquationDerivative& der : equation->get_gradient())
+    {
+        auto iter = cache->owner.find(der.parameter);
+        if (iter != cache->owner.end() && std::find(merged.cbegin(), merged.cend(), iter->second) == merged.cend())
+            merged.push_back(iter->second);
+    }
+
+    if (merged.empty())
+    {
+        cache->blocks.emplace_back( SolverContext(std::move(equation), cache->constants) );
+        cache->Own(cache->blocks.back());
+        return;
+    }
+
+    SolverBlock& block = *merged.front();
+    for (size_t b = 1; b < merged.size(); b++)
+        block.context.splice(merged[b]->context);
+
+    block.context.add(std::move(equation), cache->constants);
+    block.solver.reset(); // built again for the new equations
+
+    cache->blocks.remove_if([&merged](const SolverBlock& test) -> bool {
+        return std::find(merged.cbegin() + 1, merged.cend(), &test) != merged.cend();
+    });
+
+    cache->Own(block);
+}
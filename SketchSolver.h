@@ -0,0 +1,192 @@
+/// Sketchnator
+/// Copyright (C) 2021 Luiz Gustavo Pfitscher e Feldmann
+///
+/// This program is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef _SKETCH_SOLVER_H_
+#define _SKETCH_SOLVER_H_
+
+#include <vector>
+#include <map>
+#include <memory>
+#include "SketchEquations.h"
+
+// DECOMPOSITION
+// Factorization used to solve the linear system of each iteration
+// Tall blocks (more equations than parameters) are solved in the least squares sense
+// Wide blocks (more parameters than equations) get the minimum norm solution
+// ========================================================================================
+enum class SketchSolverDecomposition
+{
+    AUTOMATIC,              // chosen from the shape of each block
+    PARTIAL_PIVOT_LU,       // LU of square blocks, or of the normal equations of tall/wide blocks
+    CHOLESKY_LLT,           // LLT of the normal equations
+    CHOLESKY_LDLT,          // LDLT of the normal equations
+    HOUSEHOLDER_QR,         // column pivoting QR, does not square the condition number
+    COMPLETE_ORTHOGONAL,    // rank revealing, slowest but the most robust
+};
+
+// METHOD
+// Iteration used to find the solution of each block
+// ========================================================================================
+enum class SketchSolverMethod
+{
+    NEWTON_RAPHSON,         // full steps, refined by second order terms - fastest when the sketch is close to the solution
+    LEVENBERG_MARQUARDT,    // damped steps, the damping adapts to how well each step reduced the error
+    DOGLEG,                 // powell's dogleg, steps limited to an adaptive trust region
+    BROYDEN,                // quasi-newton, the jacobian is factorized once and approximated by rank-1 updates until convergence stalls
+};
+
+// STATISTICS
+// Counters of the work done by the solver, added up over all the solves they are given to (reset them to count a single solve)
+// ========================================================================================
+struct SketchSolverStatistics
+{
+    size_t steps = 0;                   // newton-raphson steps (each one evaluates and factorizes the jacobian)
+    size_t secondOrderSkipped = 0;      // steps not corrected by the second order terms - linear block, or terms within the tolerance
+    size_t secondOrderCorrected = 0;    // steps corrected by the second order terms
+    size_t secondOrderRefinements = 0;  // refinements of the corrected steps (each one factorizes the corrected jacobian)
+    size_t unfinished = 0;              // blocks the time budget ran out on, before they converged
+};
+
+// OPTIONS
+// Configures how the sketch is solved
+// ========================================================================================
+struct SketchSolverOptions
+{
+    SketchSolverMethod method = SketchSolverMethod::NEWTON_RAPHSON;
+    SketchSolverDecomposition decomposition = SketchSolverDecomposition::AUTOMATIC; // used by small (dense) blocks
+    size_t sparseThreshold = 64; // blocks with more parameters than this are assembled and factorized as sparse matrices
+    size_t iterativeThreshold = 20000; // blocks with more parameters than this are solved matrix-free by conjugate gradients (CGLS), without any factorization
+    size_t iterativeBudget = 200; // maximum conjugate gradient iterations of each matrix-free linear solution (bounds the cost of each iteration)
+    size_t parallelThreshold = 4000; // work of more equations than this is shared among threads: the blocks of a sketch are solved at the same time, and the equations of a single block are evaluated in chunks
+    size_t threads = 0; // threads solving a sketch (0 = one per processor core)
+    bool bConstructive = true; // well-constrained blocks are first solved as a sequence of small rigid clusters, falling back to the method above if that fails
+    bool bTriangular = true; // well-constrained blocks are split by their structure into square subsystems, solved one after another in dependency order
+    double timeBudget = 0; // milliseconds a solve may take (0 = no limit) - when it runs out, blocks not converged yet are left at the best iterate found (not rolled back), and counted as unfinished in the statistics
+    SketchSolverStatistics* statistics = nullptr; // if set, counters of the work done are added to it
+};
+
+// MOTION
+// Under-constrained blocks have infinitely many solutions - the solver takes the one moving the parameters the least
+// By default every parameter counts the same, but some may be made heavier (move less) than others, or pulled back to where they were
+// ========================================================================================
+struct SketchSolverMotion
+{
+    using Param = ConstraintEquation::Param;
+
+    std::map<Param*, Param> inertia;    // weight of the movement of each parameter (1 if not listed) - the heavier, the less it moves
+    std::map<Param*, Param> anchors;    // soft anchors - the movement of these parameters is measured from the given values, so they return there whenever the constraints allow
+};
+
+// CONSTRAINT STATUS
+// How a new constraint relates to the ones already in the sketch
+// ========================================================================================
+enum class SketchConstraintStatus
+{
+    INDEPENDENT,    // removes degrees of freedom - it may be solved
+    REDUNDANT,      // implied by the existing constraints, and already satisfied
+    CONFLICTING,    // implied by the existing constraints, but not satisfied - it contradicts them
+};
+
+// DEGREES OF FREEDOM
+// Of one component of the sketch (group of parameters connected by constraints)
+// ========================================================================================
+struct SketchComponentDOF
+{
+    size_t parameters;  // free parameters
+    size_t equations;   // constraint equations
+    size_t rank;        // independent equations
+
+    size_t overdetermined;  // equations in the structurally over-determined part (more equations than parameters, whatever their values)
+    size_t underdetermined; // parameters in the structurally under-determined part (more parameters than equations)
+
+    inline size_t dof() const { return parameters - rank; }         // remaining degrees of freedom
+    inline size_t redundant() const { return equations - rank; }    // equations that are redundant or conflicting
+};
+
+// SESSION
+// Keeps what the solver builds from the constraints of a sketch between solves: the equations, the blocks they split into, and the solver of each block (with it's matrices)
+// Solving the same constraints again (every frame of a drag) then only costs the iterations
+// It is rebuilt whenever the constraints change (checked on every solve), or the constant parameters or options differ from the last solve
+// The equations copy the values they depend on (the desired value of a dimension) - changing one in place must be followed by SketchConstraintList::Modified
+// ========================================================================================
+class Sketch;
+class SketchConstraint;
+class SketchSolverSession
+{
+public:
+    using Param = ConstraintEquation::Param;
+
+    SketchSolverSession();
+    ~SketchSolverSession();
+
+    // the cache is not moved along with the session (it refers to the sketch it was built from) - it is rebuilt on the next solve
+    SketchSolverSession(SketchSolverSession&& other);
+    SketchSolverSession& operator=(SketchSolverSession&& other);
+
+    // same as SketchSolver::Solve, reusing the cache if it is still valid
+    bool Solve(Sketch& sketch, const SketchSolverOptions& options = SketchSolverOptions(), const std::vector<Param*>& constantParameters = {}, const SketchSolverMotion* motion = nullptr);
+
+    // the constraint was just added to the sketch, changing the revision of it's constraints from the one given
+    // if the cache was up to date, the constraint is merged into the blocks it touches - instead of building all of them again
+    void Added(const Sketch& sketch, size_t revision, SketchConstraint& constraint);
+
+    // a value the constraint depends on was changed in place (without changing the revision of the constraints)
+    // only the blocks it's equation is in are built again - the others are kept
+    void Changed(Sketch& sketch, SketchConstraint& constraint);
+
+    // discards the cache
+    void Invalidate();
+
+protected:
+    struct Cache;
+    std::unique_ptr<Cache> cache;
+};
+
+// SOLVER
+// Finds the values of the sketch parameters satisfying all of it's constraints
+// ========================================================================================
+class SketchSolver
+{
+public:
+    using Param = ConstraintEquation::Param;
+
+    // solves all the constraints present in the sketch
+    // the constant parameters are not changed by the solver (for example, points being dragged)
+    // if failed, all the parameters are rolled back to the values they had before solving
+    // the motion (optional) weights how the parameters of under-constrained blocks move
+    static bool Solve(Sketch& sketch, const SketchSolverOptions& options = SketchSolverOptions(), const std::vector<Param*>& constantParameters = {}, const SketchSolverMotion* motion = nullptr);
+
+    // same as above, along with constraints not added to the sketch - the constraints of the sketch are not changed (only the parameters)
+    static bool SolveWith(Sketch& sketch, const std::vector<std::unique_ptr<SketchConstraint>>& constraints, const SketchSolverOptions& options = SketchSolverOptions());
+
+    // changes a value the constraint depends on (for example, the desired value of a dimension) and solves the sketch for it
+    // the target is moved from it's present value to the new one gradually (continuation) if solving for it at once fails
+    // if failed, both the target and the parameters are rolled back
+    // the steps are solved by the session, if given
+    static bool SolveContinuation(Sketch& sketch, SketchConstraint& constraint, Param& target, Param value, const SketchSolverOptions& options = SketchSolverOptions(), SketchSolverSession* session = nullptr);
+
+    // classifies a constraint (not yet added to the sketch) from the rank of the jacobian at the current geometry, without solving anything
+    static SketchConstraintStatus Classify(Sketch& sketch, SketchConstraint& constraint, const SketchSolverOptions& options = SketchSolverOptions());
+
+    // same as above for many constraints, each one against the sketch and the constraints before it (the sketch is only split once)
+    // returns the status of the first one that is not independent, if any
+    static SketchConstraintStatus Classify(Sketch& sketch, const std::vector<std::unique_ptr<SketchConstraint>>& constraints, const SketchSolverOptions& options = SketchSolverOptions());
+
+    // rank analysis of each component of the sketch
+    static std::vector<SketchComponentDOF> DegreesOfFreedom(Sketch& sketch, const SketchSolverOptions& options = SketchSolverOptions());
+};
+
+#endif // _SKETCH_SOLVER_H_
@@ -0,0 +1,389 @@
+/// Sketchnator
+/// Copyright (C) 2021 Luiz Gustavo Pfitscher e Feldmann
+///
+/// This program is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "SketchSolverThread.h"
+#include "sketch.h"
+
+const static size_t maxRefinements = 40; // of each request, in a row without finishing any more blocks, if it still runs out of time
+
+// the coordinates of all the points, in the order of the list
+static void ReadCoordinates(const Sketch& sketch, std::vector<ConstraintEquation::Param>& out)
+{
+    out.clear();
+    out.reserve(2 * sketch.points.size());
+
+    for (const SketchPoint& p : sketch.points)
+    {
+        out.push_back(p.x);
+        out.push_back(p.y);
+    }
+}
+
+// gives all the points the coordinates read before - returns false if they are not of the same points
+static bool WriteCoordinates(Sketch& sketch, const std::vector<ConstraintEquation::Param>& in)
+{
+    if (in.empty() || in.size() != 2 * sketch.points.size())
+        return false;
+
+    auto value = in.cbegin();
+    for (SketchPoint& p : sketch.points)
+    {
+        p.x = *value++;
+        p.y = *value++;
+    }
+
+    return true;
+}
+
+SketchSolverThread::SketchSolverThread(Sketch& s, std::function<void(bool)> p, double b) :
+    sketch(s),
+    published(p),
+    budget(b)
+{
+
+}
+
+SketchSolverThread::~SketchSolverThread()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        bStop = true;
+        bPending = false;
+    }
+
+    changed.notify_all();
+
+    if (worker.joinable())
+        worker.join();
+}
+
+void SketchSolverThread::Post(const std::vector<std::pair<Param*, Param>>& values, const SketchSolverMotion* motion)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        // a request still pending is stale now - it is replaced
+        pending = values;
+        pending_motion = motion;
+        bPending = true;
+
+        // started by the first request
+        if (!worker.joinable())
+            worker = std::thread(&SketchSolverThread::Run, this);
+    }
+
+    changed.notify_all();
+}
+
+void SketchSolverThread::Wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this]() { return !bPending && !bRunning; });
+    bUnfinished = false;
+}
+
+bool SketchSolverThread::RollBack()
+{
+    std::lock_guard<std::mutex> lock(access);
+    return WriteCoordinates(sketch, converged);
+}
+
+void SketchSolverThread::End()
+{
+    Wait();
+
+    std::lock_guard<std::mutex> lock(access);
+    converged.clear();
+}
+
+void SketchSolverThread::Run()
+{
+    std::vector<std::pair<Param*, Param>> values;
+    std::vector<Param*> constantParameters;
+    const SketchSolverMotion* motion = nullptr;
+    size_t refinements = 0; // of the current request, since the last one that finished any blocks
+    size_t unfinished = 0;  // blocks the last solve ran out of time on (skipped, or left at the best iterate)
+
+    for (;;)
+    {
+        bool bRefine;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this]() { return bPending || bUnfinished || bStop; });
+
+            if (bStop)
+                return;
+
+            // a new request takes over from the refinement of the previous one
+            bRefine = !bPending;
+            if (!bRefine)
+            {
+                values.swap(pending);
+                motion = pending_motion;
+                bPending = false;
+                refinements = 0;
+            }
+            else
+                refinements++;
+
+            bUnfinished = false;
+            bRunning = true;
+        }
+
+        SketchSolverStatistics statistics;
+        bool bSolved;
+        {
+            std::lock_guard<std::mutex> lock(access);
+
+            SketchSolverOptions options = sketch.solverOptions;
+            options.timeBudget = budget;
+            options.statistics = &statistics;
+
+            // apply the request - a refinement continues from where the last solve stopped, with the same values
+            // the first request of a series starts from a solution, the one returned to until another converges
+            if (!bRefine)
+            {
+                if (converged.empty())
+                    ReadCoordinates(sketch, converged);
+
+                constantParameters.clear();
+                for (std::pair<Param*, Param>& pair : values)
+                {
+                    constantParameters.push_back(pair.first);
+                    std::swap(*pair.first, pair.second);
+                }
+            }
+
+            bSolved = sketch.solverSession.Solve(sketch, options, constantParameters, motion);
+
+            // the blocks skipped by one solve are solved by the refinements that follow, a few at a time - that is progress, not a solve failing to converge
+            if (bRefine && statistics.unfinished < unfinished)
+                refinements = 0;
+
+            unfinished = statistics.unfinished;
+
+            // a solve running out of time is not a solution yet - it is given up if it still is after all the refinements
+            if (bSolved && statistics.unfinished == 0)
+                ReadCoordinates(sketch, converged);
+            else if (!bSolved || refinements >= maxRefinements)
+            {
+                WriteCoordinates(sketch, converged);
+                bSolved = false;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            bRunning = false;
+
+            // not while another request is pending (it would not be refined anyway)
+            // a solve that keeps running out of time is not converging either - it is left to the next request
+            bUnfinished = bSolved && statistics.unfinished > 0 && refinements < maxRefinements && !bPending && !bStop;
+        }
+
+        changed.notify_all();
+
+        if (published)
+            published(bSolved);
+    }
+}
+
+// PROBE THREAD
+// ========================================================================================
+SketchProbeThread::SketchProbeThread(Sketch& s, std::function<void()> p) :
+    sketch(s),
+    published(p)
+{
+
+}
+
+SketchProbeThread::~SketchProbeThread()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        bStop = true;
+        bPending = false;
+    }
+
+    changed.notify_all();
+
+    if (worker.joinable())
+        worker.join();
+}
+
+void SketchProbeThread::Post(std::vector<std::unique_ptr<SketchConstraint>>&& constraints, const Key& key)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        // a probe still pending is stale now - it is replaced
+        pending = std::move(constraints);
+        pending_key = key;
+        bPending = true;
+
+        // started by the first probe
+        if (!worker.joinable())
+            worker = std::thread(&SketchProbeThread::Run, this);
+    }
+
+    changed.notify_all();
+}
+
+void SketchProbeThread::Wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this]() { return !bPending && !bRunning; });
+}
+
+bool SketchProbeThread::TryLock()
+{
+    if (!access.try_lock())
+        return false;
+
+    holder = std::this_thread::get_id();
+    return true;
+}
+
+void SketchProbeThread::Lock()
+{
+    access.lock();
+    holder = std::this_thread::get_id();
+}
+
+void SketchProbeThread::Unlock()
+{
+    holder = std::thread::id();
+    access.unlock();
+}
+
+std::unique_lock<std::mutex> SketchProbeThread::Access()
+{
+    std::unique_lock<std::mutex> lock(access, std::defer_lock);
+    if (holder != std::this_thread::get_id())
+        lock.lock();
+
+    return lock;
+}
+
+bool SketchProbeThread::Current(const Key& key) const
+{
+    if (last.key != key || last.revision != sketch.constraints.revision() || last.coordinates.size() != 2 * sketch.points.size())
+        return false;
+
+    auto value = last.coordinates.cbegin();
+    for (const SketchPoint& p : sketch.points)
+    {
+        if (p.x != *value++ || p.y != *value++)
+            return false;
+    }
+
+    return true;
+}
+
+SketchProbeThread::Status SketchProbeThread::Result(const Key& key)
+{
+    const std::unique_lock<std::mutex> locked = Access();
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (!Current(key))
+        return Status::UNKNOWN;
+
+    return last.bFeasible ? Status::FEASIBLE : Status::INFEASIBLE;
+}
+
+bool SketchProbeThread::Commit(const Key& key)
+{
+    const std::unique_lock<std::mutex> locked = Access();
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (!last.bFeasible || !Current(key))
+        return false;
+
+    // added as by Sketch::TryAddConstraints, so the session of the sketch keeps it's blocks
+    for (std::unique_ptr<SketchConstraint>& c : last.constraints)
+    {
+        const size_t revision = sketch.constraints.revision();
+        sketch.constraints.emplace_back( std::move(c) );
+        sketch.solverSession.Added(sketch, revision, *sketch.constraints.back());
+    }
+
+    for (std::pair<Param*, Param>& pair : last.solution)
+        *pair.first = pair.second;
+
+    last = Probe();
+    return true;
+}
+
+void SketchProbeThread::Run()
+{
+    for (;;)
+    {
+        Probe probe;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this]() { return bPending || bStop; });
+
+            if (bStop)
+                return;
+
+            probe.constraints.swap(pending);
+            probe.key = pending_key;
+            bPending = false;
+            bRunning = true;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(access);
+
+            ReadCoordinates(sketch, probe.coordinates);
+            probe.revision = sketch.constraints.revision();
+
+            // same as Sketch::TryAddConstraints, but the constraints are solved along with the sketch without being added to it (nor to the session of the sketch)
+            probe.bFeasible = (SketchSolver::Classify(sketch, probe.constraints, sketch.solverOptions) == SketchConstraintStatus::INDEPENDENT);
+            if (probe.bFeasible)
+            {
+                // if not solved, the sketch is already rolled back
+                probe.bFeasible = SketchSolver::SolveWith(sketch, probe.constraints, sketch.solverOptions);
+
+                // record the solution, and take it all back
+                auto value = probe.coordinates.cbegin();
+                for (SketchPoint& p : sketch.points)
+                {
+                    if (p.x != *value)
+                        probe.solution.push_back({&p.x, p.x});
+
+                    p.x = *value++;
+
+                    if (p.y != *value)
+                        probe.solution.push_back({&p.y, p.y});
+
+                    p.y = *value++;
+                }
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            last = std::move(probe);
+            bRunning = false;
+        }
+
+        changed.notify_all();
+
+        if (published)
+            published();
+    }
+}
@@ -0,0 +1,174 @@
+/// Sketchnator
+/// Copyright (C) 2021 Luiz Gustavo Pfitscher e Feldmann
+///
+/// This program is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef _SKETCH_SOLVER_THREAD_H_
+#define _SKETCH_SOLVER_THREAD_H_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include "SketchSolver.h"
+#include "SketchConstraints.h"
+
+// SOLVER THREAD
+// Solves the sketch in the background, so a slow solve does not block the GUI (for example, while dragging)
+// Requests replace each other (latest wins) - one posted while another is pending makes it stale, so only the newest is ever solved
+// The equations refer to the parameters of the sketch itself, so they are solved in place: the sketch is locked while solving,
+// and must also be locked by the GUI while it reads or changes it - when it cannot be locked, the GUI shows what it had before (the last solution published)
+// With a time budget, each request is solved only as far as it allows (the best iterate is published), and then refined while no other request is pending
+// The sketch is never left unsolved: the last solution that converged (or the sketch as it was before the first request) is kept, and returned to when a solve fails
+// The requests of one interaction (a drag) make a series, so that solution is kept from one request to the next until the series ends
+// ========================================================================================
+class Sketch;
+class SketchSolverThread
+{
+public:
+    using Param = ConstraintEquation::Param;
+
+    // the callback is called from the worker thread after each solve (success or not), once the sketch is unlocked
+    // the budget (milliseconds, 0 = no limit) is the time of each solve - the refinements of an unfinished solve get the same
+    SketchSolverThread(Sketch& s, std::function<void(bool)> published = nullptr, double budget = 0);
+
+    // the solve in progress (if any) is finished, the pending one is dropped
+    ~SketchSolverThread();
+
+    // requests the sketch solved, after giving the parameters their values - these are constant to the solver (the points being dragged)
+    // if the solve fails (or keeps running out of time while refined), all the points return to the last solution that converged in the series
+    // the motion is not copied - it must stay unchanged until the solver is idle
+    void Post(const std::vector<std::pair<Param*, Param>>& values, const SketchSolverMotion* motion = nullptr);
+
+    // blocks until all the requests are solved - the refinement of the last one is dropped (solve the sketch to finish it)
+    void Wait();
+
+    // returns all the points to the last solution that converged in the series (for example, if solving the last request in full fails)
+    // returns false if there is none (no request was posted since the series began) - only while the thread is idle
+    bool RollBack();
+
+    // waits for the requests, and ends the series - the next request begins another one
+    void End();
+
+    // locks the sketch for the GUI, if not being solved - returns false otherwise
+    inline bool TryLock() { return access.try_lock(); }
+    inline void Unlock() { access.unlock(); }
+
+    // locks the sketch for the GUI, waiting for the solve in progress (if any) - the requests still pending are solved after it is unlocked
+    inline void Lock() { access.lock(); }
+
+protected:
+    Sketch& sketch;
+    const std::function<void(bool)> published;
+    const double budget;
+
+    std::thread worker;
+    std::mutex access;                  // held while the sketch is being solved or read by the GUI
+    std::vector<Param> converged;       // coordinates of all the points at the last solution that converged in the series (empty before the first request) - protected by access
+
+    std::mutex mutex;                   // protects the state below
+    std::condition_variable changed;
+    std::vector<std::pair<Param*, Param>> pending;
+    const SketchSolverMotion* pending_motion = nullptr;
+    bool bPending = false;
+    bool bRunning = false;
+    bool bUnfinished = false;           // the last solve ran out of time - it is refined while idle
+    bool bStop = false;
+
+    void Run();
+};
+
+// PROBE THREAD
+// Tries constraints on the sketch in the background, before the user commits to them (while a constraint tool hovers a candidate)
+// As above, the sketch is solved in place and locked meanwhile: the constraints are solved along with it, the solution is recorded, and then the coordinates are rolled back
+// The constraints are never added to the sketch while probed (nor to it's session) - so it's constraints, and what the session keeps, are untouched by the probe
+// Committing the last probe then costs nothing - the constraints are added along with the solution found, without solving again
+// Probes replace each other (latest wins), and only the result of the last one is kept
+// ========================================================================================
+class SketchProbeThread
+{
+public:
+    using Param = ConstraintEquation::Param;
+    using Key = std::pair<const void*, const void*>; // identifies the candidate the constraints were made for (the objects picked)
+
+    enum class Status
+    {
+        UNKNOWN,        // not the last one probed, not finished yet, or the sketch changed since
+        FEASIBLE,       // the constraints can be added
+        INFEASIBLE,     // the constraints would over-constrain the sketch
+    };
+
+    // the callback is called from the worker thread after each probe, once the sketch is unlocked
+    SketchProbeThread(Sketch& s, std::function<void()> published = nullptr);
+
+    // the probe in progress (if any) is finished, the pending one is dropped
+    ~SketchProbeThread();
+
+    // requests the constraints tried (they are taken, and given back by Commit if feasible)
+    void Post(std::vector<std::unique_ptr<SketchConstraint>>&& constraints, const Key& key);
+
+    // blocks until all the probes are done
+    void Wait();
+
+    // result of the probe of the candidate
+    // both read the sketch, so they lock it meanwhile (waiting for the probe in progress) - unless the calling thread already locked it, by the methods below
+    Status Result(const Key& key);
+
+    // adds the constraints of the candidate to the sketch, with the solution found for them - if they were feasible, and the sketch did not change since
+    // returns false otherwise (then they must be added as usual)
+    bool Commit(const Key& key);
+
+    // locks the sketch for the GUI, if not being probed - returns false otherwise
+    bool TryLock();
+    void Unlock();
+
+    // locks the sketch for the GUI, waiting for the probe in progress (if any)
+    void Lock();
+
+protected:
+    Sketch& sketch;
+    const std::function<void()> published;
+
+    std::thread worker;
+    std::mutex access;                  // held while the sketch is being probed or read by the GUI
+    std::atomic<std::thread::id> holder;// thread holding access through the methods above (the GUI), if any
+
+    std::mutex mutex;                   // protects the state below
+    std::condition_variable changed;
+    std::vector<std::unique_ptr<SketchConstraint>> pending;
+    Key pending_key;
+    bool bPending = false;
+    bool bRunning = false;
+    bool bStop = false;
+
+    // last probe done
+    struct Probe
+    {
+        Key key;
+        bool bFeasible = false;
+        std::vector<std::unique_ptr<SketchConstraint>> constraints;
+        std::vector<std::pair<Param*, Param>> solution; // parameters changed by solving for the constraints, and their new values
+        size_t revision = 0;                            // of the constraints of the sketch, probed
+        std::vector<Param> coordinates;                 // of all the points of the sketch, probed
+    } last;
+
+    bool Current(const Key& key) const; // the last probe is of the candidate, and the sketch did not change since
+    std::unique_lock<std::mutex> Access(); // locks the sketch for the calling thread, unless it already holds it
+    void Run();
+};
+
+#endif // _SKETCH_SOLVER_THREAD_H_
@@ -38,6 +38,10 @@ bool SketchTool::LeftDouble(const wxMouseEventEx& evt)  { return false; }
 bool SketchTool::MouseMove(const wxMouseEventEx& evt)   { return false; }
 bool SketchTool::KeyUp(wxKeyEvent& evt)         { return false; }
 bool SketchTool::KeyDown(wxKeyEvent& evt)       { return false; }
+bool SketchTool::TryLock()                      { return true; }
+void SketchTool::Unlock()                       { }
+void SketchTool::Lock()                         { }
+void SketchTool::Published()                    { }
 
 /// SELECTION
 /// ========================================================
@@ -361,17 +365,68 @@ bool SelectionSketchTool::KeyDown(wxKeyEvent& evt)
 
 /// MOVE OBJECTS
 /// ========================================================
-MoveSketchTool::MoveSketchTool(Sketch& s) :
-    SketchTool(s)
+static bool MoveToolSnapTest(const Sketch& sketch, const SketchSnaps::Vector2& mouse, const MoveSketchTool::MoveSketchTool_Filter* filter, bool bDragging, SketchSnaps::Vector2& out_snap);
+
+// milliseconds of solving for each position of a drag - large sketches are shown at the best solution found in that time, refined while the mouse rests
+const static double dragBudget = 8;
+
+MoveSketchTool::MoveSketchTool(Sketch& s, std::function<void()> published) :
+    SketchTool(s),
+    solver(s, [published](bool) {
+        if (published)
+            published();
+    }, dragBudget)
+{
+
+}
+
+MoveSketchTool::~MoveSketchTool()
+{
+    solver.Wait(); // the motion must outlive the requests referring to it
+}
+
+bool MoveSketchTool::TryLock()
+{
+    return solver.TryLock();
+}
+
+void MoveSketchTool::Unlock()
 {
+    solver.Unlock();
+}
 
+void MoveSketchTool::Lock()
+{
+    solver.Lock();
 }
 
-bool MoveSketchTool::LeftUp(const wxMouseEventEx&)
+bool MoveSketchTool::LeftUp(const wxMouseEventEx& evt)
 {
+    // the last position is solved right away and in full, without a time budget (and snapped, which may have been skipped while the solver was busy)
+    solver.Wait();
+
+    const bool bMoved = bDragged;
+    if (bDragged)
+    {
+        Coord x, y;
+        evt.GetPosition(x, y);
+        mouse = Vector2(x, y);
+
+        Vector2 snap_point;
+        if (MoveToolSnapTest(sketch, mouse, filter.get(), true, snap_point))
+            mouse = snap_point;
+
+        Move(false);
+        bDragged = false;
+    }
+
+    solver.End();
+
     initialPositions.clear();
+    motion.inertia.clear();
+    motion.anchors.clear();
     filter.reset();
-    return false;
+    return bMoved;
 }
 
 // when moving objects, we must make sure they snap only to non-selected objects (no self snapping)
@@ -386,6 +441,9 @@ struct MoveSketchTool::MoveSketchTool_Filter
 
 bool MoveSketchTool::LeftDown(const wxMouseEventEx&)
 {
+    // the previous drag may still be solving (if the button was released out of the panel)
+    solver.End();
+
     // begin movement
     dragStart = mouse;
     filter.reset( new MoveSketchTool_Filter() );
@@ -447,6 +505,42 @@ bool MoveSketchTool::LeftDown(const wxMouseEventEx&)
         }
     }
 
+    // where the sketch is under-constrained, the geometry around the dragged points should give way, but the rest should stay still
+    // so the inertia of the other points grows with their distance to the dragged ones: at the average distance they are twice as heavy
+    motion.inertia.clear();
+    motion.anchors.clear();
+
+    std::vector<std::pair<SketchPoint*, Coord>> distances;
+    Coord average = 0;
+    for (SketchPoint& p : sketch.points)
+    {
+        if (std::find_if(initialPositions.cbegin(), initialPositions.cend(), [&p](const std::pair<SketchPointList::iterator, Vector2>& test)->bool {
+            return (&*test.first == &p);
+        }) != initialPositions.cend())
+            continue; // dragged - constant
+
+        Coord closest = std::numeric_limits<Coord>::max();
+        for (const std::pair<SketchPointList::iterator, Vector2>& dragged : initialPositions)
+            closest = std::min(closest, glm::distance((const Vector2&)p, dragged.second));
+
+        distances.emplace_back(&p, closest);
+        average += closest;
+
+        // the geometry returns to where it was when the drag started, whenever the constraints allow
+        motion.anchors[&p.x] = p.x;
+        motion.anchors[&p.y] = p.y;
+    }
+
+    if (!distances.empty() && average > 0)
+    {
+        average /= distances.size();
+        for (const std::pair<SketchPoint*, Coord>& d : distances)
+        {
+            const Coord relative = d.second / average;
+            motion.inertia[&d.first->x] = motion.inertia[&d.first->y] = 1 + relative * relative;
+        }
+    }
+
     return false;
 }
 
@@ -511,39 +605,63 @@ bool MoveSketchTool::MouseMove(const wxMouseEventEx& evt)
         mouse = Vector2(x, y);
     }
 
-    // attempt snaps
-    Vector2 snap_point;
-    if (MoveToolSnapTest(sketch, mouse, filter.get(), evt.Dragging(), snap_point))
-        mouse = snap_point;
+    // attempt snaps (not while the sketch is being solved - it would not be ready before the next solve anyway)
+    if (solver.TryLock())
+    {
+        Vector2 snap_point;
+        if (MoveToolSnapTest(sketch, mouse, filter.get(), evt.Dragging(), snap_point))
+            mouse = snap_point;
+
+        solver.Unlock();
+    }
 
     // check we're actually dragging something
     if (!evt.Dragging())
         return false;
 
+    bDragged = true;
+    return Move(true);
+}
+
+bool MoveSketchTool::Move(bool bBackground)
+{
     // using the original position (saved when left button went down), calculate mouse offset
     const Vector2 offset = mouse - dragStart;
 
-    std::vector<ConstraintEquation::Param*> constantParameters;
-    constantParameters.reserve(initialPositions.size() * 2);
+    // make sure final position is set precisely by the solver (moved points are constant - ignored by solver)
+    std::vector<std::pair<ConstraintEquation::Param*, ConstraintEquation::Param>> values;
+    values.reserve(initialPositions.size() * 2);
 
     for (std::pair<SketchPointList::iterator, Vector2>& p : initialPositions)
     {
-        p.first->x = p.second.x + offset.x;
-        p.first->y = p.second.y + offset.y;
+        values.emplace_back(&p.first->x, p.second.x + offset.x);
+        values.emplace_back(&p.first->y, p.second.y + offset.y);
+    }
 
-        // make sure final position is set precisely by the solver (moved points are constant - ignored by solver)
-        constantParameters.push_back(&p.first->x);
-        constantParameters.push_back(&p.first->y);
+    // the panel is repainted when the solver publishes the solution
+    if (bBackground)
+    {
+        solver.Post(values, &motion);
+        return false;
     }
 
-    if (!sketch.Solve(constantParameters))
+    std::vector<ConstraintEquation::Param*> constantParameters;
+    constantParameters.reserve(values.size());
+
+    for (std::pair<ConstraintEquation::Param*, ConstraintEquation::Param>& pair : values)
     {
-        // if moving failed, restore original state (before moving)
-        // so the sketch is never left in an unsolvable state
-        for (std::pair<SketchPointList::iterator, Vector2>& p : initialPositions)
+        constantParameters.push_back(pair.first);
+        std::swap(*pair.first, pair.second);
+    }
+
+    if (!sketch.Solve(constantParameters, &motion))
+    {
+        // if moving failed, restore the last solution of the drag (the solves in the background may have left the sketch unconverged)
+        // or at least the previous position of the dragged points - so the sketch is never left in an unsolvable state
+        if (!solver.RollBack())
         {
-            p.first->x = p.second.x;
-            p.first->y = p.second.y;
+            for (std::pair<ConstraintEquation::Param*, ConstraintEquation::Param>& pair : values)
+                *pair.first = pair.second;
         }
     }
 
@@ -685,64 +803,66 @@ bool SingleSelectionEditTool::MouseMove(const wxMouseEventEx& evt)
 /// ConsecutiveSelectionSketchTool
 /// Selects two objects of mixed type in a row
 /// =========================================================
-bool AbstractConsecutiveSelectionSketchTool::LeftDown(const wxMouseEventEx& evt)
+bool AbstractConsecutiveSelectionSketchTool::Dispatch()
 {
-    bool bResult = false;
     if (dynamic_cast<SketchPoint*>(highlight))
     {
         if (dynamic_cast<SketchPoint*>(previous))
-            bResult = this->OnPointPoint(currentPoint, previousPoint);
+            return this->OnPointPoint(currentPoint, previousPoint);
 
         else if (dynamic_cast<SketchLine*>(previous))
-            bResult = this->OnPointLine(currentPoint, previousLine);
+            return this->OnPointLine(currentPoint, previousLine);
 
         else if (dynamic_cast<SketchCircle*>(previous))
-            bResult = this->OnPointCircle(currentPoint, previousCircle);
-
-        if (!bResult)
-            previousPoint = currentPoint;
+            return this->OnPointCircle(currentPoint, previousCircle);
     }
     else if (dynamic_cast<SketchLine*>(highlight))
     {
         if (dynamic_cast<SketchPoint*>(previous))
-            bResult = this->OnPointLine(previousPoint, currentLine);
+            return this->OnPointLine(previousPoint, currentLine);
 
         else if (dynamic_cast<SketchLine*>(previous))
-            bResult = this->OnLineLine(currentLine, previousLine);
+            return this->OnLineLine(currentLine, previousLine);
 
         else if (dynamic_cast<SketchCircle*>(previous))
-            bResult = this->OnLineCircle(currentLine, previousCircle);
-
-        if (!bResult)
-            previousLine = currentLine;
+            return this->OnLineCircle(currentLine, previousCircle);
     }
     else if (dynamic_cast<SketchCircle*>(highlight))
     {
         if (dynamic_cast<SketchPoint*>(previous))
-            bResult = this->OnPointCircle(previousPoint, currentCircle);
+            return this->OnPointCircle(previousPoint, currentCircle);
 
         else if (dynamic_cast<SketchLine*>(previous))
-            bResult = this->OnLineCircle(previousLine, currentCircle);
+            return this->OnLineCircle(previousLine, currentCircle);
 
         else if (dynamic_cast<SketchCircle*>(previous))
-            bResult = this->OnCircleCircle(currentCircle, previousCircle);
-
-        if (!bResult)
-            previousCircle = currentCircle;
+            return this->OnCircleCircle(currentCircle, previousCircle);
     }
 
-    if (bResult)
+    return false;
+}
+
+bool AbstractConsecutiveSelectionSketchTool::LeftDown(const wxMouseEventEx& evt)
+{
+    if (Dispatch())
     {
         // operation complete - erase history (start fresh, don't chain operations)
         previous = NULL;
         return true;
     }
-    else
-    {
-        // operation pending - save for later
-        previous = highlight;
-        return false;
-    }
+
+    // operation pending - save for later
+    if (dynamic_cast<SketchPoint*>(highlight))
+        previousPoint = currentPoint;
+
+    else if (dynamic_cast<SketchLine*>(highlight))
+        previousLine = currentLine;
+
+    else if (dynamic_cast<SketchCircle*>(highlight))
+        previousCircle = currentCircle;
+
+    previous = highlight;
+    return false;
 }
 
 bool ConsecutiveSelectionSketchTool::OnPointPoint(SketchPointList::iterator&, SketchPointList::iterator&) {return false;}
@@ -752,6 +872,128 @@ bool ConsecutiveSelectionSketchTool::OnLineLine(SketchLineList::iterator&, Sketc
 bool ConsecutiveSelectionSketchTool::OnLineCircle(SketchLineList::iterator&, SketchCircleList::iterator&) {return false;}
 bool ConsecutiveSelectionSketchTool::OnCircleCircle(SketchCircleList::iterator&, SketchCircleList::iterator&) {return false;}
 
+/// ConstraintSketchTool
+/// Places constraints between two objects, probing them while hovered
+/// =========================================================
+ConstraintSketchTool::ConstraintSketchTool(Sketch& s, std::function<void()> published) :
+    ConsecutiveSelectionSketchTool(s),
+    probe(s, published)
+{
+
+}
+
+bool ConstraintSketchTool::TryLock()
+{
+    return probe.TryLock();
+}
+
+void ConstraintSketchTool::Unlock()
+{
+    probe.Unlock();
+}
+
+void ConstraintSketchTool::Lock()
+{
+    probe.Lock();
+}
+
+void ConstraintSketchTool::PlaceBatch(std::vector<std::unique_ptr<SketchConstraint>>& constraints)
+{
+    if (probing)
+    {
+        for (std::unique_ptr<SketchConstraint>& c : constraints)
+            probing->push_back( std::move(c) );
+
+        return;
+    }
+
+    sketch.TryAddConstraints(constraints);
+}
+
+void ConstraintSketchTool::Probe()
+{
+    if (!previous || !highlight)
+        return;
+
+    std::vector<std::unique_ptr<SketchConstraint>> constraints;
+
+    probing = &constraints;
+    const bool bApplies = Dispatch();
+    probing = NULL;
+
+    if (bApplies && !constraints.empty())
+        probe.Post(std::move(constraints), Candidate());
+}
+
+bool ConstraintSketchTool::MouseMove(const wxMouseEventEx& evt)
+{
+    // the sketch can't be read while it is being probed - the highlight is updated on the next move (or click)
+    if (!probe.TryLock())
+        return false;
+
+    const bool bChanged = ConsecutiveSelectionSketchTool::MouseMove(evt);
+    if (bChanged && highlight)
+    {
+        switch (probe.Result(Candidate()))
+        {
+            case SketchProbeThread::Status::INFEASIBLE:
+                highlight->bSelected = false;
+                break;
+
+            case SketchProbeThread::Status::UNKNOWN:
+                Probe();
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    probe.Unlock();
+    return bChanged;
+}
+
+void ConstraintSketchTool::Published()
+{
+    if (!highlight || !probe.TryLock())
+        return;
+
+    if (probe.Result(Candidate()) == SketchProbeThread::Status::INFEASIBLE)
+        highlight->bSelected = false;
+
+    probe.Unlock();
+}
+
+bool ConstraintSketchTool::LeftDown(const wxMouseEventEx& evt)
+{
+    // the highlight may be behind the mouse, if it moved while probing
+    probe.Wait();
+    UpdateHighlight(GetHover(evt));
+
+    if (previous && highlight)
+    {
+        switch (probe.Result(Candidate()))
+        {
+            case SketchProbeThread::Status::INFEASIBLE:
+                highlight->bSelected = false;
+                return false; // would over-constrain - it can't be picked
+
+            case SketchProbeThread::Status::FEASIBLE:
+                // already solved for - operation complete
+                if (!probe.Commit(Candidate()))
+                    break;
+
+                previous = NULL;
+                return true;
+
+            default:
+                break;
+        }
+    }
+
+    return ConsecutiveSelectionSketchTool::LeftDown(evt);
+}
+
 /// SPLIT/TRIM LINES
 /// ========================================================
 static std::list<SketchIntersection::Vector2> ToolFindIntersections(const Sketch& sketch, const SketchSelectable* highlight)
@@ -1336,10 +1578,21 @@ void AutomaticConstraintPlacement::SetSuggested(std::list<SketchConstraint*>&& n
 
 void AutomaticConstraintPlacement::PlaceSuggestedConstraints(Sketch& sketch)
 {
+    std::vector<std::unique_ptr<SketchConstraint>> batch;
     for (std::unique_ptr<SketchConstraint>& c : suggestedConstraints)
-        sketch.TryAddConstraint( std::move(c), false );
+        batch.push_back( std::move(c) );
 
     suggestedConstraints.clear();
+
+    PlaceConstraints(sketch, batch);
+}
+
+void AutomaticConstraintPlacement::PlaceConstraints(Sketch& sketch, std::vector<std::unique_ptr<SketchConstraint>>& constraints)
+{
+    if (sketch.TryAddConstraints(constraints, false).empty())
+        for (std::unique_ptr<SketchConstraint>& c : constraints)
+            if (c)
+                sketch.TryAddConstraint( std::move(c), false );
 }
 
 /// LINE
@@ -1837,13 +2090,21 @@ public:
     }
 
     // when placing on the sketch for good ...
-    // ... create the constraints that make this rectangle a rectangle
-    virtual void CommitConstraints(Sketch& sketch)
+    // ... create the constraints that make this rectangle a rectangle (all of them solved at once, unless some of them are redundant)
+    void CommitConstraints(Sketch& sketch)
     {
-        sketch.TryAddConstraint( std::make_unique<HorizontalConstraint>(ab) );
-        sketch.TryAddConstraint( std::make_unique<HorizontalConstraint>(cd) );
-        sketch.TryAddConstraint( std::make_unique<VerticalConstraint>(bc) );
-        sketch.TryAddConstraint( std::make_unique<VerticalConstraint>(da) );
+        std::vector<std::unique_ptr<SketchConstraint>> constraints;
+        MakeConstraints(constraints);
+
+        AutomaticConstraintPlacement::PlaceConstraints(sketch, constraints);
+    }
+
+    virtual void MakeConstraints(std::vector<std::unique_ptr<SketchConstraint>>& constraints)
+    {
+        constraints.push_back( std::make_unique<HorizontalConstraint>(ab) );
+        constraints.push_back( std::make_unique<HorizontalConstraint>(cd) );
+        constraints.push_back( std::make_unique<VerticalConstraint>(bc) );
+        constraints.push_back( std::make_unique<VerticalConstraint>(da) );
     }
 
     // move one corder during creation
@@ -1961,12 +2222,12 @@ public:
         d->y = c->y;
     }
 
-    void CommitConstraints(Sketch& sketch)
+    void MakeConstraints(std::vector<std::unique_ptr<SketchConstraint>>& constraints)
     {
-        SketchRectangle::CommitConstraints(sketch);
+        SketchRectangle::MakeConstraints(constraints);
 
-        sketch.TryAddConstraint( std::make_unique<ParallelConstraint>(ap, cp) );
-        sketch.TryAddConstraint( std::make_unique<ParallelConstraint>(bp, dp) );
+        constraints.push_back( std::make_unique<ParallelConstraint>(ap, cp) );
+        constraints.push_back( std::make_unique<ParallelConstraint>(bp, dp) );
     }
 };
 
@@ -2219,9 +2480,10 @@ bool DimensionSketchTool::LeftDouble(const wxMouseEventEx& evt)
     if (!DimensionEditDialog::Show(dim))
         return false;
 
-    // update sketch
-    if (!sketch.Solve())
-        dim->DesiredValue = saved; // restore previous if unsolvable
+    // update sketch, moving from the saved value to the new one
+    const auto value = dim->DesiredValue;
+    dim->DesiredValue = saved;
+    sketch.SolveContinuation(**currentDimension, dim->DesiredValue, value); // restores previous if unsolvable
 
     state = DimensionSketchToolState::DSTS_RESET; // finish editing
     return true;
@@ -2273,6 +2535,7 @@ bool DimensionSketchTool::MouseMove(const wxMouseEventEx& evt)
 
         // when moving a dimension it's type (and measurement) may change, so also update the desired value to match current value
         dim->DesiredValue = dim->GetValue();
+        sketch.constraints.Modified(); // the equation of the dimension is not the same anymore
 
         return true;
     }
@@ -2336,10 +2599,10 @@ bool CoincidentSketchTool::OnPointPoint(SketchPointList::iterator& a, SketchPoin
     if (a == b)
         return false;
 
-    sketch.TryAddConstraints({
+    Place(
         std::make_unique<PointOnPointAxisConstraint>(a, b, true),
         std::make_unique<PointOnPointAxisConstraint>(a, b, false)
-    }, 2);
+    );
 
     return true;
 }
@@ -2349,7 +2612,7 @@ bool CoincidentSketchTool::OnPointLine(SketchPointList::iterator& p, SketchLineL
     if (l->IsEndpoint(p))
         return false;
 
-    sketch.TryAddConstraint(std::make_unique<PointOnLineConstraint>(p,  l));
+    Place( std::make_unique<PointOnLineConstraint>(p,  l) );
 
     return true;
 }
@@ -2359,7 +2622,7 @@ bool CoincidentSketchTool::OnPointCircle(SketchPointList::iterator& p, SketchCir
     if (c->IsCenterOrRadius(p))
         return false;
 
-    sketch.TryAddConstraint(std::make_unique<PointOnCircumferenceConstraint>(p,  c));
+    Place( std::make_unique<PointOnCircumferenceConstraint>(p,  c) );
 
     return true;
 }
@@ -2370,10 +2633,10 @@ bool ColinearSketchTool::OnLineLine(SketchLineList::iterator& first, SketchLineL
     if (first == second)
         return false; // no same twice
 
-    sketch.TryAddConstraints({
+    Place(
         std::make_unique<PointOnLineConstraint>(first->first,  second),
         std::make_unique<PointOnLineConstraint>(first->second, second)
-    }, 2);
+    );
 
     return true;
 }
@@ -2384,10 +2647,10 @@ bool ConcentricSketchTool::OnCircleCircle(SketchCircleList::iterator& first, Ske
     if (first == second)
         return false;
 
-    sketch.TryAddConstraints({
+    Place(
        std::make_unique<PointOnPointAxisConstraint>(first->center, second->center, true),
        std::make_unique<PointOnPointAxisConstraint>(first->center, second->center, false)
-    }, 2);
+    );
 
     return true;
 }
@@ -2395,7 +2658,7 @@ bool ConcentricSketchTool::OnCircleCircle(SketchCircleList::iterator& first, Ske
 // TangentSketchTool
 bool TangentSketchTool::OnLineCircle(SketchLineList::iterator& line, SketchCircleList::iterator& circle)
 {
-    sketch.TryAddConstraint( std::make_unique<TangentLineConstraint>(line, circle) );
+    Place( std::make_unique<TangentLineConstraint>(line, circle) );
 
     return true;
 }
@@ -2405,7 +2668,7 @@ bool TangentSketchTool::OnCircleCircle(SketchCircleList::iterator& first, Sketch
     if (first == second)
         return false;
 
-    sketch.TryAddConstraint( std::make_unique<TangentCircleConstraint>(first, second) );
+    Place( std::make_unique<TangentCircleConstraint>(first, second) );
 
     return true;
 }
@@ -2416,7 +2679,7 @@ bool EqualSketchTool::OnLineLine(SketchLineList::iterator& first, SketchLineList
     if (first == second)
         return false;
 
-    sketch.TryAddConstraint( std::make_unique<EqualLengthConstraint>(first, second) );
+    Place( std::make_unique<EqualLengthConstraint>(first, second) );
 
     return true;
 }
@@ -2426,7 +2689,7 @@ bool EqualSketchTool::OnCircleCircle(SketchCircleList::iterator& first, SketchCi
     if (first == second)
         return false;
 
-    sketch.TryAddConstraint( std::make_unique<EqualRadiusConstraint>(first, second) );
+    Place( std::make_unique<EqualRadiusConstraint>(first, second) );
 
     return true;
 }
@@ -2437,7 +2700,7 @@ bool ParallelSketchTool::OnLineLine(SketchLineList::iterator& first, SketchLineL
     if (first == second)
         return false;
 
-    sketch.TryAddConstraint( std::make_unique<ParallelConstraint>(first, second) );
+    Place( std::make_unique<ParallelConstraint>(first, second) );
 
     return true;
 }
@@ -2448,7 +2711,7 @@ bool OrthogonalSketchTool::OnLineLine(SketchLineList::iterator& first, SketchLin
     if (first == second)
         return false;
 
-     sketch.TryAddConstraint( std::make_unique<OrthogonalConstraint>(first, second) );
+     Place( std::make_unique<OrthogonalConstraint>(first, second) );
 
     return true;
 }
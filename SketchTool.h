@@ -18,6 +18,7 @@
 #define _SKETCH_TOOLS_H_
 
 #include "sketch.h"
+#include "SketchSolverThread.h"
 #include <wx/event.h>
 #include "enum_flag_operators.h"
 #include "ExtendedMouseEvent.h"
@@ -49,6 +50,17 @@ public:
     virtual bool MouseMove(const wxMouseEventEx& evt);
     virtual bool KeyUp(wxKeyEvent& evt);
     virtual bool KeyDown(wxKeyEvent& evt);
+
+    // tools may solve the sketch in the background - the panel locks it before painting
+    // returns false if it is being solved (then it must not be read)
+    virtual bool TryLock();
+    virtual void Unlock();
+
+    // same as above, waiting for the solve in progress (if any) - before the sketch is read or changed outside of the tool (saved, exported...)
+    virtual void Lock();
+
+    // called by the panel (on the GUI thread) when a result found in the background is published, before painting it
+    virtual void Published();
 };
 
 /// SELECTION
@@ -100,16 +112,28 @@ public:
 class MoveSketchTool : public SketchTool
 {
 public:
-    MoveSketchTool(Sketch& s); // must declare and implement constructor because of incomplete type struct MoveSketchTool_Filter
+    // the sketch is solved in the background while dragging, a few milliseconds per position (refined while the mouse rests) - the callback is called (from the solver thread) when each solution is ready to be painted
+    MoveSketchTool(Sketch& s, std::function<void()> published = nullptr); // must declare and implement constructor because of incomplete type struct MoveSketchTool_Filter
+    ~MoveSketchTool();
 
     bool LeftUp(const wxMouseEventEx& evt);
     bool LeftDown(const wxMouseEventEx& evt);
     bool MouseMove(const wxMouseEventEx& evt);
 
+    bool TryLock();
+    void Unlock();
+    void Lock();
+
     struct MoveSketchTool_Filter;
 
 protected:
+    SketchSolverThread solver;
+    bool bDragged = false; // the mouse moved since the left button went down
+
+    bool Move(bool bBackground); // moves the dragged points to follow the mouse, and solves the sketch (in the background, or right away)
+
     std::list<std::pair<SketchPointList::iterator, Vector2>> initialPositions;
+    SketchSolverMotion motion; // the points far from the dragged ones are heavier, and all are anchored to where they were when the drag started
     Vector2 mouse;     // cursor position updated every OnMouseMove event
     Vector2 dragStart; // set when LeftDown is called to keep track of dragging motion
     std::unique_ptr<MoveSketchTool_Filter> filter;
@@ -164,6 +188,9 @@ protected:
     virtual bool OnLineCircle(SketchLineList::iterator&, SketchCircleList::iterator&) = 0;
     virtual bool OnCircleCircle(SketchCircleList::iterator&, SketchCircleList::iterator&) = 0;
 
+    // calls the function above treating the combination of the previous and the highlighted objects - returns false if it does not apply
+    bool Dispatch();
+
 public:
     using SingleSelectionEditTool::SingleSelectionEditTool;
     virtual bool LeftDown(const wxMouseEventEx& evt);
@@ -184,6 +211,44 @@ public:
     using AbstractConsecutiveSelectionSketchTool::AbstractConsecutiveSelectionSketchTool;
 };
 
+// CONSTRAINT TOOL
+// Places constraints between two objects picked in sequence
+// While the second one is hovered, the constraints it would take are probed in the background - so the click only commits the result
+// Candidates that would over-constrain the sketch are not highlighted, and can't be picked
+// =========================================================
+class ConstraintSketchTool : public ConsecutiveSelectionSketchTool
+{
+public:
+    // the callback is called (from the probe thread) when each probe is done
+    ConstraintSketchTool(Sketch& s, std::function<void()> published = nullptr);
+
+    bool LeftDown(const wxMouseEventEx& evt);
+    bool MouseMove(const wxMouseEventEx& evt);
+    void Published();
+
+    bool TryLock();
+    void Unlock();
+    void Lock();
+
+protected:
+    SketchProbeThread probe;
+    std::vector<std::unique_ptr<SketchConstraint>>* probing = NULL; // while set, the constraints placed are only collected there
+
+    // adds the constraints to the sketch, solving it once for all of them
+    template<class... Constraints>
+    void Place(Constraints&&... constraints)
+    {
+        std::vector<std::unique_ptr<SketchConstraint>> batch;
+        (batch.emplace_back( std::forward<Constraints>(constraints) ), ...);
+        PlaceBatch(batch);
+    }
+
+    void PlaceBatch(std::vector<std::unique_ptr<SketchConstraint>>& constraints);
+
+    inline SketchProbeThread::Key Candidate() const { return SketchProbeThread::Key(previous, highlight); }
+    void Probe(); // probes the constraints a click on the highlighted object would place
+};
+
 /// SPLIT/TRIM
 /// ========================================================
 class SplitSketchTool : public SingleSelectionEditTool
@@ -232,6 +297,9 @@ struct AutomaticConstraintPlacement
 public:
     static bool bAutoConstrain; // should constraints be placed automatically during feature creation?
 
+    // all together, solving the sketch once - if they do not fit together, as many of them as possible, one by one (those left out are dropped quietly)
+    static void PlaceConstraints(Sketch& sketch, std::vector<std::unique_ptr<SketchConstraint>>& constraints);
+
 private:
     std::list<std::unique_ptr<SketchConstraint>> suggestedConstraints;
 
@@ -373,57 +441,57 @@ public:
 using HorizontalSketchTool = OneLineConstraintSketchTool<HorizontalConstraint>;
 using VerticalSketchTool = OneLineConstraintSketchTool<VerticalConstraint>;
 
-class CoincidentSketchTool : public ConsecutiveSelectionSketchTool
+class CoincidentSketchTool : public ConstraintSketchTool
 {
 public:
-    using ConsecutiveSelectionSketchTool::ConsecutiveSelectionSketchTool;
+    using ConstraintSketchTool::ConstraintSketchTool;
 
     bool OnPointPoint(SketchPointList::iterator&, SketchPointList::iterator&);
     bool OnPointLine(SketchPointList::iterator&, SketchLineList::iterator&);
     bool OnPointCircle(SketchPointList::iterator&, SketchCircleList::iterator&);
 };
 
-class ColinearSketchTool : public ConsecutiveSelectionSketchTool
+class ColinearSketchTool : public ConstraintSketchTool
 {
 public:
-    inline ColinearSketchTool(Sketch& s) : ConsecutiveSelectionSketchTool(s) { Filter = SketchSelectionFilter::SSF_LINE; }
+    inline ColinearSketchTool(Sketch& s, std::function<void()> published = nullptr) : ConstraintSketchTool(s, published) { Filter = SketchSelectionFilter::SSF_LINE; }
     bool OnLineLine(SketchLineList::iterator&, SketchLineList::iterator&);
 };
 
-class ConcentricSketchTool : public ConsecutiveSelectionSketchTool
+class ConcentricSketchTool : public ConstraintSketchTool
 {
 public:
-    inline ConcentricSketchTool(Sketch& s) : ConsecutiveSelectionSketchTool(s) { Filter = SketchSelectionFilter::SSF_CIRCLE; }
+    inline ConcentricSketchTool(Sketch& s, std::function<void()> published = nullptr) : ConstraintSketchTool(s, published) { Filter = SketchSelectionFilter::SSF_CIRCLE; }
     bool OnCircleCircle(SketchCircleList::iterator&, SketchCircleList::iterator&);
 };
 
-class TangentSketchTool : public ConsecutiveSelectionSketchTool
+class TangentSketchTool : public ConstraintSketchTool
 {
 public:
-    inline TangentSketchTool(Sketch& s) : ConsecutiveSelectionSketchTool(s) { Filter = SketchSelectionFilter::SSF_LINE | SketchSelectionFilter::SSF_CIRCLE; }
+    inline TangentSketchTool(Sketch& s, std::function<void()> published = nullptr) : ConstraintSketchTool(s, published) { Filter = SketchSelectionFilter::SSF_LINE | SketchSelectionFilter::SSF_CIRCLE; }
     bool OnLineCircle(SketchLineList::iterator&, SketchCircleList::iterator&);
     bool OnCircleCircle(SketchCircleList::iterator&, SketchCircleList::iterator&);
 };
 
-class EqualSketchTool : public ConsecutiveSelectionSketchTool
+class EqualSketchTool : public ConstraintSketchTool
 {
 public:
-    inline EqualSketchTool(Sketch& s) : ConsecutiveSelectionSketchTool(s) { Filter = SketchSelectionFilter::SSF_LINE | SketchSelectionFilter::SSF_CIRCLE; }
+    inline EqualSketchTool(Sketch& s, std::function<void()> published = nullptr) : ConstraintSketchTool(s, published) { Filter = SketchSelectionFilter::SSF_LINE | SketchSelectionFilter::SSF_CIRCLE; }
     bool OnLineLine(SketchLineList::iterator&, SketchLineList::iterator&);
     bool OnCircleCircle(SketchCircleList::iterator&, SketchCircleList::iterator&);
 };
 
-class ParallelSketchTool : public ConsecutiveSelectionSketchTool
+class ParallelSketchTool : public ConstraintSketchTool
 {
 public:
-    inline ParallelSketchTool(Sketch& s) : ConsecutiveSelectionSketchTool(s) { Filter = SketchSelectionFilter::SSF_LINE; }
+    inline ParallelSketchTool(Sketch& s, std::function<void()> published = nullptr) : ConstraintSketchTool(s, published) { Filter = SketchSelectionFilter::SSF_LINE; }
     bool OnLineLine(SketchLineList::iterator&, SketchLineList::iterator&);
 };
 
-class OrthogonalSketchTool : public ConsecutiveSelectionSketchTool
+class OrthogonalSketchTool : public ConstraintSketchTool
 {
 public:
-    inline OrthogonalSketchTool(Sketch& s) : ConsecutiveSelectionSketchTool(s) { Filter = SketchSelectionFilter::SSF_LINE; }
+    inline OrthogonalSketchTool(Sketch& s, std::function<void()> published = nullptr) : ConstraintSketchTool(s, published) { Filter = SketchSelectionFilter::SSF_LINE; }
     bool OnLineLine(SketchLineList::iterator&, SketchLineList::iterator&);
 };
 
@@ -0,0 +1,309 @@
+/// Sketchnator
+/// Copyright (C) 2021 Luiz Gustavo Pfitscher e Feldmann
+///
+/// This program is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// SOLVER BENCHMARK
+// Times the sketch solver on generated sketches, to compare the ways it can be configured
+// It is the "Benchmark" target of the project: the same sources as the application, with this file instead of main.cpp
+// Without Code::Blocks, from the folder of the sources (with the include directories of the project added):
+//   g++ -std=gnu++17 -O2 `wx-config --cxxflags` $(ls *.cpp | grep -v "^main.cpp$") `wx-config --libs` -lhpdf -pthread -o SolverBenchmark
+// Usage: SolverBenchmark [decomposition|setup]
+// ========================================================================================
+#include <cstdio>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <memory>
+#include <limits>
+#include <algorithm>
+#include "sketch.h"
+#include "SketchDimensionalConstraints.h"
+
+using Param = ConstraintEquation::Param;
+
+// CORPUS
+// Frameworks of points held by distance dimensions, shaped so the solver gets a single block of a known shape
+// Some coordinates are fixed (constant parameters, as the points dragged by the user), so the block is not free to move as a whole
+// ========================================================================================
+struct BenchmarkSketch
+{
+    const char* shape;
+    Sketch sketch;
+    std::vector<Param*> constants;
+    std::vector<Param> solution; // coordinates of all the points, as built
+};
+
+static void Dimension(Sketch& sketch, SketchPointList::iterator a, SketchPointList::iterator b)
+{
+    SketchDimensionLinear* dimension = new SketchDimensionLinear(a, b);
+    dimension->DesiredValue = dimension->GetValue();
+    sketch.constraints.add(dimension);
+}
+
+static void Finish(BenchmarkSketch& s)
+{
+    for (const SketchPoint& p : s.sketch.points)
+    {
+        s.solution.push_back(p.x);
+        s.solution.push_back(p.y);
+    }
+}
+
+// triangle strip - each point is held by the two before it, rigid with no redundancy: as many equations as parameters
+static std::unique_ptr<BenchmarkSketch> Strip(size_t count, std::mt19937& rng)
+{
+    std::unique_ptr<BenchmarkSketch> s(new BenchmarkSketch());
+    s->shape = "square";
+
+    std::uniform_real_distribution<Param> jitter(-2, 2);
+    std::vector<SketchPointList::iterator> points;
+    for (size_t i = 0; i < count; i++)
+    {
+        points.push_back( s->sketch.points.add(10 * i + jitter(rng), 8 * (i % 2) + jitter(rng)) );
+
+        if (i >= 1)
+            Dimension(s->sketch, points[i - 1], points[i]);
+
+        if (i >= 2)
+            Dimension(s->sketch, points[i - 2], points[i]);
+    }
+
+    s->constants = {&points[0]->x, &points[0]->y, &points[1]->y};
+    Finish(*s);
+    return s;
+}
+
+// grid braced by one diagonal on each cell - rigid, with more equations than parameters (consistent, as they were measured)
+static std::unique_ptr<BenchmarkSketch> Mesh(size_t columns, size_t rows, std::mt19937& rng)
+{
+    std::unique_ptr<BenchmarkSketch> s(new BenchmarkSketch());
+    s->shape = "tall";
+
+    std::uniform_real_distribution<Param> jitter(-2, 2);
+    std::vector<SketchPointList::iterator> points;
+    for (size_t r = 0; r < rows; r++)
+    {
+        for (size_t c = 0; c < columns; c++)
+        {
+            points.push_back( s->sketch.points.add(10 * c + jitter(rng), 10 * r + jitter(rng)) );
+
+            const size_t i = points.size() - 1;
+            if (c >= 1)
+                Dimension(s->sketch, points[i - 1], points[i]);
+
+            if (r >= 1)
+                Dimension(s->sketch, points[i - columns], points[i]);
+
+            if (r >= 1 && c >= 1)
+                Dimension(s->sketch, points[i - columns - 1], points[i]);
+        }
+    }
+
+    s->constants = {&points[0]->x, &points[0]->y, &points[1]->y};
+    Finish(*s);
+    return s;
+}
+
+// open chain - each link only holds the distance between it's ends: fewer equations than parameters
+static std::unique_ptr<BenchmarkSketch> Chain(size_t count, std::mt19937& rng)
+{
+    std::unique_ptr<BenchmarkSketch> s(new BenchmarkSketch());
+    s->shape = "wide";
+
+    std::uniform_real_distribution<Param> jitter(-2, 2);
+    std::vector<SketchPointList::iterator> points;
+    for (size_t i = 0; i < count; i++)
+    {
+        points.push_back( s->sketch.points.add(10 * i + jitter(rng), 5 * std::sin(Param(i)) + jitter(rng)) );
+
+        if (i >= 1)
+            Dimension(s->sketch, points[i - 1], points[i]);
+    }
+
+    s->constants = {&points[0]->x, &points[0]->y};
+    Finish(*s);
+    return s;
+}
+
+// separate triangles - each one a rigid block of its own, as the many small shapes of a large drawing
+static std::unique_ptr<BenchmarkSketch> Triangles(size_t count, std::mt19937& rng)
+{
+    std::unique_ptr<BenchmarkSketch> s(new BenchmarkSketch());
+    s->shape = "blocks";
+
+    std::uniform_real_distribution<Param> jitter(-2, 2);
+    for (size_t i = 0; i < count; i++)
+    {
+        SketchPointList::iterator a = s->sketch.points.add(20 * i + jitter(rng), jitter(rng));
+        SketchPointList::iterator b = s->sketch.points.add(20 * i + 10 + jitter(rng), jitter(rng));
+        SketchPointList::iterator c = s->sketch.points.add(20 * i + 5 + jitter(rng), 8 + jitter(rng));
+
+        Dimension(s->sketch, a, b);
+        Dimension(s->sketch, b, c);
+        Dimension(s->sketch, c, a);
+    }
+
+    Finish(*s);
+    return s;
+}
+
+// moves every point (but the fixed coordinates) away from the solution, the same way for every configuration compared
+static void Perturb(BenchmarkSketch& s, std::mt19937& rng, Param amount)
+{
+    std::normal_distribution<Param> offset(0, amount);
+
+    auto value = s.solution.cbegin();
+    for (SketchPoint& p : s.sketch.points)
+    {
+        p.x = *value++;
+        p.y = *value++;
+
+        if (std::find(s.constants.cbegin(), s.constants.cend(), &p.x) == s.constants.cend())
+            p.x += offset(rng);
+
+        if (std::find(s.constants.cbegin(), s.constants.cend(), &p.y) == s.constants.cend())
+            p.y += offset(rng);
+    }
+}
+
+static double Milliseconds(const std::chrono::steady_clock::time_point& start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// DECOMPOSITION
+// Each policy factorizes the jacobian of every step, so it is compared on blocks of every shape, at the sizes solved densely
+// The blocks are solved numerically as a whole (not as rigid clusters or subsystems, which would hide the factorization)
+// ========================================================================================
+static void BenchmarkDecomposition()
+{
+    const size_t trials = 200;
+
+    const struct { SketchSolverDecomposition decomposition; const char* name; } policies[] = {
+        {SketchSolverDecomposition::AUTOMATIC,              "automatic"},
+        {SketchSolverDecomposition::PARTIAL_PIVOT_LU,       "partial pivot LU"},
+        {SketchSolverDecomposition::CHOLESKY_LLT,           "cholesky LLT"},
+        {SketchSolverDecomposition::CHOLESKY_LDLT,          "cholesky LDLT"},
+        {SketchSolverDecomposition::HOUSEHOLDER_QR,         "householder QR"},
+        {SketchSolverDecomposition::COMPLETE_ORTHOGONAL,    "complete orthogonal"},
+    };
+
+    std::mt19937 rng(1);
+    std::vector<std::unique_ptr<BenchmarkSketch>> corpus;
+    for (size_t size : {8, 16, 32})
+    {
+        corpus.push_back( Strip(size, rng) );
+        corpus.push_back( Mesh(size / 4 + 1, 4, rng) );
+        corpus.push_back( Chain(size, rng) );
+    }
+
+    std::printf("%-7s %6s %9s  %-20s %8s %8s %12s\n", "shape", "params", "equations", "decomposition", "solved", "steps", "ms/solve");
+
+    for (std::unique_ptr<BenchmarkSketch>& s : corpus)
+    {
+        const size_t count = sizeof(policies) / sizeof(policies[0]);
+        std::vector<SketchSolverStatistics> statistics(count);
+        std::vector<size_t> solved(count, 0);
+        std::vector<double> time(count, 0);
+
+        // the policies take turns on the same starting points, so they are all equally affected by anything else running
+        std::mt19937 perturbation(2);
+        for (size_t t = 0; t < trials; t++)
+        {
+            Perturb(*s, perturbation, 0.5);
+
+            std::vector<Param> start;
+            for (const SketchPoint& p : s->sketch.points)
+            {
+                start.push_back(p.x);
+                start.push_back(p.y);
+            }
+
+            for (size_t i = 0; i < count; i++)
+            {
+                auto value = start.cbegin();
+                for (SketchPoint& p : s->sketch.points)
+                {
+                    p.x = *value++;
+                    p.y = *value++;
+                }
+
+                SketchSolverOptions options;
+                options.decomposition = policies[i].decomposition;
+                options.sparseThreshold = std::numeric_limits<size_t>::max();
+                options.parallelThreshold = std::numeric_limits<size_t>::max();
+                options.bConstructive = false;
+                options.bTriangular = false;
+                options.statistics = &statistics[i];
+
+                const auto begin = std::chrono::steady_clock::now();
+                solved[i] += SketchSolver::Solve(s->sketch, options, s->constants);
+                time[i] += Milliseconds(begin);
+            }
+        }
+
+        const size_t parameters = 2 * s->sketch.points.size() - s->constants.size();
+        for (size_t i = 0; i < count; i++)
+            std::printf("%-7s %6zu %9zu  %-20s %4zu/%-3zu %8.2f %12.4f\n", s->shape, parameters, s->sketch.constraints.size(), policies[i].name,
+                solved[i], trials, double(statistics[i].steps) / trials, time[i] / trials);
+    }
+}
+
+// SETUP
+// Solving a sketch first builds the equations and splits them into blocks, which is all a solve costs when the sketch is already solved
+// So solving solved sketches times the setup alone, which should grow linearly with the count of constraints (the time per constraint stays flat)
+// Both many small blocks and a single block spanning the whole sketch are timed, as the split merges the equations differently
+// ========================================================================================
+static void BenchmarkSetup()
+{
+    std::printf("%-7s %11s %7s %12s %16s\n", "shape", "constraints", "blocks", "ms/solve", "us/constraint");
+
+    std::mt19937 rng(1);
+    for (size_t constraints : {300, 3000, 30000, 300000})
+    {
+        std::unique_ptr<BenchmarkSketch> corpus[] = {Triangles(constraints / 3, rng), Chain(constraints + 1, rng)};
+        for (std::unique_ptr<BenchmarkSketch>& s : corpus)
+        {
+            // about as many constraints set up at every size, so each size takes about as long
+            const size_t trials = std::max<size_t>(3, 1000000 / constraints);
+            const size_t blocks = (s->shape == std::string("blocks")) ? constraints / 3 : 1;
+
+            bool bSolved = true;
+            const auto begin = std::chrono::steady_clock::now();
+            for (size_t t = 0; t < trials; t++)
+                bSolved &= SketchSolver::Solve(s->sketch);
+
+            const double time = Milliseconds(begin) / trials;
+            std::printf("%-7s %11zu %7zu %12.4f %16.4f%s\n", s->shape, s->sketch.constraints.size(), blocks, time, 1000 * time / s->sketch.constraints.size(),
+                bSolved ? "" : " (failed)");
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const char* which = (argc > 1) ? argv[1] : nullptr;
+
+    if (!which || std::strcmp(which, "decomposition") == 0)
+        BenchmarkDecomposition();
+
+    if (!which || std::strcmp(which, "setup") == 0)
+        BenchmarkSetup();
+
+    return 0;
+}
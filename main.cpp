@@ -67,7 +67,10 @@ protected:
 
         SerializationContext sc;
         AutoSerializationOut sout(std::ofstream( (const char*)current_filename.mbc_str() ));
+
+        m_panelSketch->LockSketch();
         sout << m_panelSketch->document;
+        m_panelSketch->UnlockSketch();
     }
 
     void OpenDocument(const wxString& path)
@@ -225,7 +228,9 @@ public:
         page.SetWidthMM(m_panelSketch->document.layout.page_width);
         page.SetHeightMM(m_panelSketch->document.layout.page_height);
 
+        m_panelSketch->LockSketch();
         SketchRenderer::Render(m_panelSketch->document.sketch, m_panelSketch->document.layout, page);
+        m_panelSketch->UnlockSketch();
 
         pdf.SaveToFile( (const char*)saveFileDialog.GetPath().mbc_str() );
 
@@ -273,18 +278,26 @@ public:
     }
 
     void btn_Move( wxCommandEvent& event ) {
-        m_panelSketch->Tool<MoveSketchTool>();
+        m_panelSketch->Tool<MoveSketchTool>( std::bind(&SketchPanel::PublishSolution, m_panelSketch) );
     }
 
     void btn_construction( wxCommandEvent& event ) {
         CreationSketchTool::creationStyle = (m_toggle_construction->GetValue() ? SketchFeatureType::CONSTRUCTION : SketchFeatureType::NORMAL);
+
+        m_panelSketch->LockSketch();
         CreationSketchTool::ApplyToCurrentSelection(m_panelSketch->document.sketch);
+        m_panelSketch->UnlockSketch();
+
         m_panelSketch->Refresh();
     }
 
     void btn_centerline( wxCommandEvent& event ) {
         CreationSketchTool::creationStyle = (m_toggle_centerline->GetValue() ? SketchFeatureType::CENTERLINE : SketchFeatureType::NORMAL);
+
+        m_panelSketch->LockSketch();
         CreationSketchTool::ApplyToCurrentSelection(m_panelSketch->document.sketch);
+        m_panelSketch->UnlockSketch();
+
         m_panelSketch->Refresh();
     }
 
@@ -333,31 +346,31 @@ public:
     }
 
     void btn_coincident( wxCommandEvent& event ){
-        m_panelSketch->Tool<CoincidentSketchTool>();
+        m_panelSketch->Tool<CoincidentSketchTool>( std::bind(&SketchPanel::PublishSolution, m_panelSketch) );
     }
 
     void btn_concentric( wxCommandEvent& event ) {
-        m_panelSketch->Tool<ConcentricSketchTool>();
+        m_panelSketch->Tool<ConcentricSketchTool>( std::bind(&SketchPanel::PublishSolution, m_panelSketch) );
     }
 
     void btn_colinear( wxCommandEvent& event ){
-        m_panelSketch->Tool<ColinearSketchTool>();
+        m_panelSketch->Tool<ColinearSketchTool>( std::bind(&SketchPanel::PublishSolution, m_panelSketch) );
     }
 
     void btn_parallel( wxCommandEvent& event ) {
-        m_panelSketch->Tool<ParallelSketchTool>();
+        m_panelSketch->Tool<ParallelSketchTool>( std::bind(&SketchPanel::PublishSolution, m_panelSketch) );
     }
 
     void btn_tangent( wxCommandEvent& event ) {
-        m_panelSketch->Tool<TangentSketchTool>();
+        m_panelSketch->Tool<TangentSketchTool>( std::bind(&SketchPanel::PublishSolution, m_panelSketch) );
     }
 
     void btn_orthogonal( wxCommandEvent& event ) {
-        m_panelSketch->Tool<OrthogonalSketchTool>();
+        m_panelSketch->Tool<OrthogonalSketchTool>( std::bind(&SketchPanel::PublishSolution, m_panelSketch) );
     }
 
     void btn_equal( wxCommandEvent& event ) {
-        m_panelSketch->Tool<EqualSketchTool>();
+        m_panelSketch->Tool<EqualSketchTool>( std::bind(&SketchPanel::PublishSolution, m_panelSketch) );
     }
 
     void btn_horizontal( wxCommandEvent& event ) {
@@ -20,6 +20,7 @@
 #include "SketchAnnotation.h"
 #include "SketchConstraints.h"
 #include "SketchFeatures.h"
+#include "SketchSolver.h"
 
 // CONSTRAINTS
 // ============================================================================
@@ -45,21 +46,34 @@ public:
     SketchConstraintList constraints;
     SketchAnnotationList annotations;
 
+    // SOLVER
+    // ============================================================================
+    SketchSolverOptions solverOptions; // not serialized - it's an application preference, not sketch data
+    SketchSolverSession solverSession; // not serialized - rebuilt from the constraints whenever they change
+
     // METHODS
     // ============================================================================
 
     // uses Newton-Raphson to solve sketch enforcing all present constraints
-    // additional ad-hoc equations may be provided (note those pointers will invariably be deleted when function returns)
-    bool Solve(const std::vector<ConstraintEquation::Param*>& constantParameters = {});
+    // the constant parameters are kept as they are by the solver (for example, the points being dragged)
+    // the motion (optional) weights how far each of the other parameters may move, where the sketch is under-constrained
+    bool Solve(const std::vector<ConstraintEquation::Param*>& constantParameters = {}, const SketchSolverMotion* motion = nullptr);
+
+    // changes a value the constraint depends on (the desired value of a dimension) to a new one, and solves the sketch for it
+    // large changes are taken in smaller steps if needed - if failed, the value and sketch are rolled back
+    bool SolveContinuation(SketchConstraint& constraint, Coord& target, Coord value);
 
     // adds constraint and attempts solving the sketch
     // if succeeded, returns iterator to the added constraint
     // if failed, sketch is rolled back, constraint is removed, pointer is deleted, returns iterator to constraints.end()
     SketchConstraintList::iterator TryAddConstraint(std::unique_ptr<SketchConstraint> newConstraint, bool msgBox = true);
 
-    // adds multiple constraints and attempts solving the sketch
-    // if successful, returns iterators to all the just-added items
-    // if failed, sketch is rolled back, empty vector is returned
+    // adds multiple constraints and attempts solving the sketch once, for all of them
+    // if successful, returns iterators to all the just-added items (the pointers in the vector are moved out)
+    // if failed, sketch is rolled back, none of the constraints is added (they are returned to the vector), empty vector is returned
+    std::vector<SketchConstraintList::iterator> TryAddConstraints(std::vector<std::unique_ptr<SketchConstraint>>& newConstraints, bool msgBox = true);
+
+    // same as above, the constraints are deleted if failed
     std::vector<SketchConstraintList::iterator> TryAddConstraints(std::unique_ptr<SketchConstraint>(&&newConstraints)[], size_t count, bool msgBox = true);
 };
 
@@ -29,7 +29,7 @@ SketchPanel::SketchPanel(wxWindow *parent, wxWindowID winid, const wxPoint& pos,
 
 SketchPanel::~SketchPanel()
 {
-
+    currentTool.reset(); // waits for a tool solving in the background, while the panel can still receive it's events
 }
 
 BEGIN_EVENT_TABLE(SketchPanel, wxPanel)
@@ -44,9 +44,42 @@ EVT_MOTION(SketchPanel::OnMouseMove)
 EVT_MOUSEWHEEL(SketchPanel::OnMouseWheel)
 END_EVENT_TABLE()
 
+void SketchPanel::PublishSolution()
+{
+    CallAfter([this]() {
+        if (currentTool)
+            currentTool->Published();
+
+        Refresh();
+    });
+}
+
 void SketchPanel::OnPaint(wxPaintEvent& evt)
 {
-    wxBufferedPaintDC dc(this);
+    // the sketch is being solved in the background - it can't be read until the solution is published, so the last frame is shown again
+    if (currentTool && !currentTool->TryLock())
+    {
+        wxPaintDC dc(this);
+        if (frame.IsOk())
+            dc.DrawBitmap(frame, 0, 0);
+
+        return;
+    }
+
+    // the frame is kept in the buffer
+    const wxSize size = GetClientSize();
+    if (!frame.IsOk() || frame.GetWidth() != size.GetWidth() || frame.GetHeight() != size.GetHeight())
+        frame.Create(std::max(1, size.GetWidth()), std::max(1, size.GetHeight()));
+
+    PaintFrame(frame);
+
+    if (currentTool)
+        currentTool->Unlock();
+}
+
+void SketchPanel::PaintFrame(wxBitmap& buffer)
+{
+    wxBufferedPaintDC dc(this, buffer);
 
     // clear background
     dc.SetBackground(*wxWHITE_BRUSH);
@@ -18,6 +18,7 @@
 #define _SKETCH_PANEL_H_
 
 #include <wx/panel.h>
+#include <wx/bitmap.h>
 #include "SketchTool.h"
 #include "Document.h"
 
@@ -25,6 +26,7 @@ class SketchPanel : public wxPanel
 {
 private:
     std::unique_ptr<SketchTool> currentTool;
+    wxBitmap frame; // last frame painted - painted again while the sketch is being solved in the background
 
     struct SelectionDragBoxInfo
     {
@@ -33,6 +35,8 @@ private:
         SketchFeature::Vector2 b;
     } dragBox;
 
+    void PaintFrame(wxBitmap& buffer); // draws everything, through the buffer
+
 public:
     AppDocument document;
 
@@ -61,6 +65,11 @@ public:
     }
     void EndTool();
 
+    // the sketch may be solved in the background by the current tool - it must be locked before it is read or changed from elsewhere (saved, exported, edited)
+    // waits for the solve in progress, if any
+    inline void LockSketch()    { if (currentTool) currentTool->Lock(); }
+    inline void UnlockSketch()  { if (currentTool) currentTool->Unlock(); }
+
     inline bool AcceptsFocus() const {
         return true;
     }
@@ -74,6 +83,9 @@ public:
 
     void ZoomPageExtents();
 
+    // called by tools solving in the background (from their thread) when a result is ready to be painted
+    void PublishSolution();
+
     void OnPaint(wxPaintEvent& evt);
     void OnLeftUp(wxMouseEvent& evt);
     void OnLeftDown(wxMouseEvent& evt);